@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Links FILES generated objects with SECTIONS sections each.
+# Every section carries 8 bytes and one relocation against a global symbol
+# defined in the previous file, so placement, symbol resolution and
+# relocation patching all scale with the input.
+# usage: bench/linker_sections.sh [FILES] [SECTIONS]
+
+FILES=${1:-1000}
+SECTIONS=${2:-50}
+LINKER=${LINKER:-./linker}
+DIR=$(mktemp -d)
+
+awk -v files="$FILES" -v sections="$SECTIONS" -v dir="$DIR" 'BEGIN {
+  for (f = 0; f < files; f++) {
+    out = sprintf("%s/obj%05d.o", dir, f)
+    prev = (f + files - 1) % files
+
+    print "#.symtab" > out
+    print "Num Value Type Bind Ndx Name" > out
+    print "0 0 SCTN LOC UND UND" > out
+    for (s = 1; s <= sections; s++)
+      printf "%d 0 SCTN LOC %d sec%d\n", s, s, s > out
+    printf "%d 4 NOTYP GLOB 1 sym%d\n", sections + 1, f > out
+    printf "%d 0 NOTYP GLOB UND sym%d\n", sections + 2, prev > out
+    print "" > out
+
+    for (s = 1; s <= sections; s++) {
+      printf "#.sec%d\n00 00 00 00 00 00 00 00 \n\n", s > out
+    }
+
+    for (s = 1; s <= sections; s++) {
+      printf "#.rela.sec%d\nOffset Symbol Addend\n4 %d 0\n\n", s, sections + 2 > out
+    }
+    close(out)
+  }
+}'
+
+echo "LINKER BENCH | $FILES files x $SECTIONS sections"
+time "$LINKER" -hex -place=sec1@0x40000000 -o "$DIR/program.hex" "$DIR"/obj*.o > /dev/null
+
+[ -n "$KEEP" ] && echo "LINKER BENCH | kept $DIR" || rm -r "${DIR:?}"
@@ -2,36 +2,73 @@
 #define ASSEMBLER_HPP
 
 #include "../inc/util.hpp"
+#include <unordered_map>
 
 class Assembler
 {
 private:
   string inputFileName;
+  ostringstream messages; // progress output, printed once the file is done
   int locationCounter = 0;
   int currentSection = 0;
+  bool failed = false; // set by error(), the parser stops at the end of the line
 
   vector<SymbolEntry> symbolTable;
+  unordered_map<string, int> symbolIds; // name -> first index in symbolTable
+
+  // Literal pool of the current section, deduplicated by symbol name or value
+  vector<PoolEntry> poolEntries;
+  vector<PoolReference> poolRefs;
+  unordered_map<string, int> poolSymbols;
+  unordered_map<int, int> poolLiterals;
+
+  // Peephole window: words emitted since the last pool, optimized just before it is placed
+  bool optimize = false;
+  int removedCnt = 0;
+  int windowStart = 0;
+  vector<bool> windowCode; // per word, false for data
+  vector<int> windowLabels;
+  bool windowAligned = true;
   vector<SectionEntry> sectionTable;
 
 public:
   Assembler() {}
   ~Assembler() {}
 
-  void init(string);
+  // Getters
+  vector<SymbolEntry> &getSymbolTable() { return symbolTable; }
+  vector<SectionEntry> &getSectionTable() { return sectionTable; }
+
+  bool assemble(string, bool = false);
+  void init(string, bool = false);
+  void error(const string &);
+  bool hasFailed() { return failed; }
+  string getMessages();
   void printOutput(ofstream &);
+  void writeObject(ofstream &);
   int getSymbolId(string);
   int addToSymbolTable(string);
   void addToSectionRelocs(string, int);
   void fillMemoryIncLc(char, char, char, char);
+  void appendWord(char, char, char, char, bool);
   void poolSymbol(char, char, char, char, char, string);
   bool poolNeeded(int);
   void poolLiteral(int, vector<char>, vector<char>);
+  int poolEntry(string, int);
+  void reservePool(int);
+  void flushPool(bool);
+  bool fallsThrough();
+  void placePool();
+  void flushPoolBeforeData();
+  void resetWindow();
+  void peephole();
   void _global(string);
   void _extern(string);
   void _section(string);
   void _word(string);
   void _word(int);
   void _skip(int);
+  void _ltorg();
   void _end();
   void _label(string);
   void _halt();
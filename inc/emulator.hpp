@@ -2,35 +2,324 @@
 #define EMULATOR_HPP
 
 #include "../inc/util.hpp"
+#include <unordered_map>
+#include <thread>
+#include <chrono>
+#include <termios.h>
+
+class TraceSink
+{
+private:
+  ostream *output = &cout;
+  ofstream file;
+  string fileName; // empty for stdout
+  vector<char> buffer;
+
+public:
+  TraceSink() { buffer.reserve(TRACE_BUFFER_SIZE); }
+  ~TraceSink() { flush(); }
+
+  bool open(string);
+  const string &getFileName() { return fileName; }
+  void write(unsigned int, unsigned int, const char *);
+  void flush();
+};
+
+// Samples the pc on a retired-instruction period and keeps a shadow call stack
+class Profiler
+{
+private:
+  string outputName;
+  unsigned long long period = 1;
+  unsigned long long sampleCnt = 0;
+  vector<ProfileNode> nodes; // 0 is the root, entered at the start pc
+  unordered_map<unsigned long long, int> children; // parent << 32 | entry -> node
+  vector<pair<int, unsigned int>> stack;            // node and return address per active call
+  unordered_map<unsigned int, unique_ptr<unsigned long long[]>> pcSamples; // per page, one counter per word
+  unsigned int lastPage = ~0u;
+  unsigned long long *lastCounters = nullptr;
+  vector<pair<unsigned int, string>> symbols; // sorted by address
+
+public:
+  void open(string name) { outputName = name; }
+  void setPeriod(unsigned long long p) { period = p ? p : 1; }
+  unsigned long long getPeriod() { return period; }
+  bool loadSymbols(string);
+  string symbolize(unsigned int);
+  void start(unsigned int);
+  void call(unsigned int, unsigned int);
+  void ret(unsigned int);
+  int currentNode() { return stack.empty() ? 0 : stack.back().first; }
+  void count(unsigned int, unsigned long long);
+  void countNode(int, unsigned long long);
+  void sample(unsigned int);
+  bool write();
+};
+
+// Writes snapshot records on a background thread, one record in flight at a time
+class SnapshotWriter
+{
+private:
+  ofstream file;
+  thread worker;
+  vector<char> pending;
+
+public:
+  SnapshotWriter() {}
+  ~SnapshotWriter() { wait(); }
+
+  bool open(string, bool);
+  bool isOpen() { return file.is_open(); }
+  void write(vector<char> &);
+  void wait();
+};
+
+// Records asynchronous events into a compact log or feeds a recorded log back in
+class EventLog
+{
+private:
+  ofstream file;
+  vector<unsigned char> buffer; // pending output when recording, the whole log when replaying
+  size_t position = 0;
+  unsigned long long last = 0; // retired count of the previous event
+  bool replaying = false;
+
+public:
+  EventLog() {}
+  ~EventLog() { flush(); }
+
+  bool openRecord(string, unsigned long long);
+  bool openReplay(string, unsigned long long);
+  bool isRecording() { return file.is_open(); }
+  bool isReplaying() { return replaying; }
+  void record(unsigned long long, LoggedEvent, unsigned char);
+  bool next(unsigned long long &, LoggedEvent &, unsigned char &);
+  void flush();
+};
+
+class Terminal
+{
+private:
+  CharRing output{TERMINAL_RING_SIZE};
+  CharRing input{TERMINAL_RING_SIZE};
+  thread worker;
+  atomic<bool> running{false};
+  mutex writer; // every cpu writes, the ring takes one producer
+  int inputFd = -1;
+  bool ownsInput = false;
+  bool capturing = false; // headless: output is kept, no I/O thread
+  string captured;
+
+  void run();
+
+public:
+  Terminal() {}
+  ~Terminal() { stop(); }
+
+  void capture() { capturing = true; }
+  const string &getCaptured() { return captured; }
+  bool openInput(string);
+  bool hasInput() { return inputFd >= 0; }
+  void start(bool);
+  void stop();
+  void write(char);
+  bool read(char &);
+};
 
 class Emulator
 {
 private:
   bool emulation = true;
 
-  vector<EmulatorMemoryEntry> memory;
+  shared_ptr<EmulatorMemory> memory = make_shared<EmulatorMemory>();
+  vector<pair<void *, size_t>> mappedImages;
   vector<unsigned int> regs;
   vector<unsigned int> csrRegs;
 
+  // Cpu 0 owns the devices and the other cpus, which share its memory and terminal
+  unsigned int cpuId = 0;
+  unsigned int cpuCnt = 1;
+  vector<unsigned int> cpuStarts; // start pc per cpu, PC_START for the rest
+  Emulator *machine = this;
+  vector<unique_ptr<Emulator>> cpus;
+  atomic<bool> ipiPending{false};
+
+  // Kept by cpu 0: a fault or limit on any cpu ends the run of every cpu
+  mutex machineLock;
+  atomic<bool> machineStopped{false};
+  EmulatorStop machineStopReason = STOP_HALT;
+  string machineError;
+
+  // Devices: one deadline per event, the loops only compare against the earliest
+  unsigned long long retired = 0;
+  unsigned long long nextEvent = NEVER;
+  unsigned long long eventDeadlines[EVENT_COUNT];
+  unsigned int pendingInterrupts = 0; // bit per cause
+  unsigned int timerConfig = 0;
+  unsigned long long timerDelay = 0; // left over from a restored snapshot
+  Terminal terminal;
+
+  // Snapshots
+  string snapshotName;
+  string restoreName;
+  unsigned long long snapshotPeriod = SNAPSHOT_PERIOD;
+  bool snapshotFull = true; // next record must hold every page
+  SnapshotWriter snapshots;
+
+  // Record/replay of asynchronous events
+  string recordName;
+  string replayName;
+  EventLog events;
+  unsigned long long replayAt = NEVER; // next replayed event
+  LoggedEvent replayType = LOGGED_TERMINAL;
+  unsigned char replayValue = 0;
+
+  // Limits, checked through the event schedule
+  unsigned long long maxInstructions = NEVER;
+  unsigned long long timeoutMs = 0;
+  chrono::steady_clock::time_point deadline;
+  EmulatorStop stopReason = STOP_HALT;
+  string error;
+  bool headless = false; // faults end the run instead of the process
+
+  EmulatorCore core = CORE_SWITCH;
+  TraceLevel traceLevel = TRACE_NONE;
+  TraceSink trace;
+  bool profiling = false;
+  bool profileBlocks = false; // exact counts kept per translated block
+  Profiler profiler;
+
+  // Decoded instruction cache
+  DecodedInstruction uncached;
+  unsigned long long cacheHits = 0;
+  unsigned long long cacheMisses = 0;
+
+  // Translated basic blocks
+  unordered_map<unsigned int, unique_ptr<TranslatedBlock>> blocks;
+  unordered_map<unsigned int, vector<unsigned int>> pageBlocks;
+  vector<unique_ptr<TranslatedBlock>> retiredBlocks;
+  TranslatedBlock *currentBlock = nullptr;
+  bool blockExit = false;
+  unsigned long long blocksTranslated = 0;
+  unsigned long long blocksExecuted = 0;
+
+  // Run statistics, the class counts are only complete once emulate() returns
+  unsigned long long classCounts[OPCODE_CLASSES] = {};
+  double hostSeconds = 0;
+  unsigned long long startRetired = 0; // a restored run starts from its snapshot's count
+
 public:
   Emulator() {}
-  ~Emulator() {}
+  Emulator(Emulator &, unsigned int);
+  ~Emulator();
+
+  void setCore(EmulatorCore c) { core = c; }
+  void setTrace(TraceLevel level) { traceLevel = level; }
+  TraceSink &getTrace() { return trace; }
+  Terminal &getTerminal() { return terminal; }
+  bool isRestoring() { return !restoreName.empty(); }
+  void setHeadless();
+  void setLimits(unsigned long long, unsigned long long);
 
+  bool parseOption(const string &);
+  bool loadImage(string);
+  bool loadBinary(int, size_t);
   void loadMemory(ifstream &);
+  void loadSections(const vector<LinkerMemoryEntry> &);
   void initRegisters();
+  void initDevices();
+  bool restoreSnapshot();
+  void takeSnapshot();
+  void schedule(EmulatorEvent, unsigned long long);
+  void updateNextEvent();
+  void serviceEvents();
+  unsigned long long nextLimitCheck();
+  void stop(EmulatorStop);
+  void stopMachine(EmulatorStop, const string &);
+  void fault(const string &);
+  void deliverTerminal(unsigned char);
+  void replayNext();
+  void raiseInterrupt(unsigned int);
+  void sendInterrupt(unsigned int);
+  void retryInterrupts();
+  void enterInterrupt(unsigned int);
+  void deviceWrite(unsigned int, unsigned int);
+  void writeCsr(unsigned int, unsigned int);
   void printOutput();
+  string getResult(const string &);
+  void printCacheStats();
+  vector<unsigned long long> sumClassCounts();
+  void printStats();
+  EmulatorPage *findPage(unsigned int);
+  EmulatorPage *touchPage(unsigned int);
+  EmulatorPage *mapPage(unsigned int, unsigned char *);
   unsigned char findByte(unsigned int);
+  void addByte(unsigned int, unsigned char);
+  Instruction decodeInstruction(unsigned int);
   Instruction getInstruction();
+  InstructionHandler getHandler(unsigned char);
+  InstructionHandler getOpcodeHandler(unsigned char);
+  DecodedInstruction &fetchInstruction();
+  void invalidateDecoded(EmulatorPage *, unsigned int);
+  void markCode(EmulatorPage *);
+  void publishStore(EmulatorPage *);
+  void syncCode(EmulatorPage *, unsigned int);
   unsigned int getFromMemory(unsigned int);
   void addToMemory(unsigned int, unsigned int);
   void emulate();
+  template <TraceLevel level>
+  void run();
+  template <TraceLevel level>
+  void runThreaded();
+  template <TraceLevel level>
+  void runBlocks();
+  TranslatedBlock *findBlock(unsigned int);
+  function<void()> translate(Instruction, unsigned int);
+  void flushBlockCounts(TranslatedBlock &);
+  void collectClassCounts();
+  void invalidateBlocks(unsigned int, unsigned int);
+  void handleHalt(Instruction&);
+  void handleInt(Instruction&);
   void handleCall(Instruction&);
   void handleJump(Instruction&);
+  void handleXchg(Instruction&);
   void handleArit(Instruction&);
   void handleLogic(Instruction&);
   void handleShift(Instruction&);
   void handleStore(Instruction&);
   void handleLoad(Instruction&);
+  void handleInvalid(Instruction&);
+  void opCallMod0(Instruction&);
+  void opCallMod1(Instruction&);
+  void opJmpMod0(Instruction&);
+  void opJmpMod1(Instruction&);
+  void opJmpMod2(Instruction&);
+  void opJmpMod3(Instruction&);
+  void opJmpMod4(Instruction&);
+  void opJmpMod5(Instruction&);
+  void opJmpMod6(Instruction&);
+  void opJmpMod7(Instruction&);
+  void opAdd(Instruction&);
+  void opSub(Instruction&);
+  void opMul(Instruction&);
+  void opDiv(Instruction&);
+  void opNot(Instruction&);
+  void opAnd(Instruction&);
+  void opOr(Instruction&);
+  void opXor(Instruction&);
+  void opShl(Instruction&);
+  void opShr(Instruction&);
+  void opStoreMod0(Instruction&);
+  void opStoreMod1(Instruction&);
+  void opStoreMod2(Instruction&);
+  void opLoadMod0(Instruction&);
+  void opLoadMod1(Instruction&);
+  void opLoadMod2(Instruction&);
+  void opLoadMod3(Instruction&);
+  void opLoadMod4(Instruction&);
+  void opLoadMod5(Instruction&);
+  void opLoadMod6(Instruction&);
+  void opLoadMod7(Instruction&);
 };
 
 #endif
\ No newline at end of file
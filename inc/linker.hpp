@@ -2,16 +2,40 @@
 #define LINKER_HPP
 
 #include "../inc/util.hpp"
-#include <unordered_set>
+#include <unordered_map>
 
-class Linker
+// Streams 8-byte "address: xx xx ..." lines through one reusable buffer
+class HexWriter
 {
 private:
-  int sectionCnt = 0;
+  ostream &output;
+  vector<char> buffer;
+  size_t used = 0;
+  unsigned int lineAddress = 0;
+  int lineFill = 0; // bytes on the open line, 0 if none is open
+
+  void endLine();
+
+public:
+  HexWriter(ostream &os) : output(os), buffer(HEX_BUFFER_SIZE) {}
+  ~HexWriter() { flush(); }
+
+  void write(unsigned int, const char *, size_t);
+  void flush();
+};
 
+class Linker
+{
+private:
   vector<FileEntry> fileEntries;
   vector<LinkerMemoryEntry> linkerMemory;
-  unordered_set<string> processedSections;
+  // Section names interned in order of first appearance, UND is 0
+  unordered_map<string, int> sectionIds;
+  vector<string> sectionNames;
+  vector<vector<SectionEntry *>> sectionInputs; // per name, in command-line order
+  vector<bool> processedSections;
+  vector<int> outputIndex; // per name, index into linkerMemory or -1
+  unordered_map<string, int> globalSymbols; // name -> resolved address
 
 public:
   Linker() {}
@@ -24,8 +48,15 @@ public:
   // For main
   vector<SectionPlace> extractSectionPlaces(int, char *argv[]);
   vector<string> extractInputFiles(int, int, char *argv[]);
+  static SectionPlace parseSectionPlace(const string &);
 
   // Other
+  bool parseFile(const string &, FileEntry &);
+  bool parseObject(const string &, FileEntry &);
+  bool parseFiles(const vector<string> &);
+  int internSection(const string &);
+  void indexSections();
+  void placeSection(int, unsigned int &);
   void parseSymbols(ifstream &, FileEntry &);
   void parseSections(ifstream &, FileEntry &);
   void parseRelocs(ifstream &, FileEntry &);
@@ -33,10 +64,17 @@ public:
   void fillMemory(vector<SectionPlace>);
   void resolveSymbols();
   void resolveRelocs();
-  void writeMemContent(ofstream &, unsigned int &, LinkerMemoryEntry &, int, int);
-  int writeMem(ofstream &, bool &, LinkerMemoryEntry &);
-  int fillLine(ofstream &, bool, bool &, LinkerMemoryEntry &);
   void writeLinkerOutput(ofstream &);
+  void writeBinaryOutput(ofstream &);
+  void writeSymbolMap(ofstream &);
+
+  // Incremental linking
+  static uint64_t hashFile(const string &);
+  bool readCache(const string &, LinkCache &);
+  bool writeCache(const string &, const LinkCache &);
+  void cacheObject(FileEntry &, CachedObject &);
+  LinkCache buildCache(const vector<string> &, const vector<SectionPlace> &);
+  bool relink(const string &, const vector<string> &, const vector<SectionPlace> &);
 };
 
 #endif
\ No newline at end of file
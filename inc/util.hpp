@@ -7,6 +7,10 @@
 #include <string>
 #include <vector>
 #include <iomanip>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <mutex>
 using namespace std;
 
 constexpr auto PC_START = 0x40000000;
@@ -14,6 +18,8 @@ constexpr auto PC_START = 0x40000000;
 constexpr auto STATUS_REG = 0;
 constexpr auto HANDLER_REG = 1;
 constexpr auto CAUSE_REG = 2;
+constexpr auto CPUID_REG = 3; // read-only, the index of the cpu reading it
+constexpr auto CSR_COUNT = 4;
 constexpr auto ACC_REG = 13;
 constexpr auto SP_REG = 14;
 constexpr auto PC_REG = 15;
@@ -29,6 +35,12 @@ constexpr auto SHIFT_OC = 0b01110000;
 constexpr auto STORE_OC = 0b10000000;
 constexpr auto LOAD_OC = 0b10010000;
 
+// Opcode classes are indexed by op >> 4; the unused ones are skipped and counted as "invalid"
+constexpr auto OPCODE_CLASSES = 16;
+constexpr auto INVALID_CLASS = 10;
+constexpr const char *OPCODE_CLASS_NAMES[OPCODE_CLASSES] = {"halt", "int", "call", "jump", "xchg", "arit", "logic", "shift",
+                                                            "store", "load", "invalid", "invalid", "invalid", "invalid", "invalid", "invalid"};
+
 constexpr auto CALL_MOD0 = 0b0000;
 constexpr auto CALL_MOD1 = 0b0001;
 
@@ -69,6 +81,120 @@ constexpr auto LOAD_MOD7 = 0b0111;
 
 constexpr auto WIDTH = 14;
 
+// Interrupt causes and status register mask bits
+constexpr auto TIMER_CAUSE = 2;
+constexpr auto TERMINAL_CAUSE = 3;
+constexpr auto SOFTWARE_CAUSE = 4;
+constexpr auto IPI_CAUSE = 5;
+
+constexpr auto STATUS_TIMER_MASK = 0x1;
+constexpr auto STATUS_TERMINAL_MASK = 0x2;
+constexpr auto STATUS_INTERRUPT_MASK = 0x4;
+
+// Memory-mapped device registers
+constexpr auto MMIO_START = 0xFFFFFF00u;
+constexpr auto TERM_OUT = 0xFFFFFF00u;
+constexpr auto TERM_IN = 0xFFFFFF04u;
+constexpr auto TIM_CFG = 0xFFFFFF10u;
+constexpr auto IPI_SEND = 0xFFFFFF20u; // a write interrupts the cpu with the written index
+
+// Virtual time: the timer counts retired instructions, this many per millisecond
+constexpr auto INSTRUCTIONS_PER_MS = 1000ull;
+constexpr unsigned int TIMER_PERIODS_MS[] = {500, 1000, 1500, 2000, 5000, 10000, 30000, 60000};
+
+// Terminal input is polled every 10 ms of virtual time
+constexpr auto TERMINAL_POLL_INTERVAL = 10 * INSTRUCTIONS_PER_MS;
+constexpr auto TERMINAL_RING_SIZE = 1 << 16;
+
+// Guest cpus run on host threads; each polls its inter-processor interrupt flag this often
+constexpr auto MAX_CPUS = 16;
+constexpr auto IPI_POLL_INTERVAL = 100ull;
+
+enum EmulatorEvent
+{
+  EVENT_TIMER,
+  EVENT_TERMINAL,
+  EVENT_PROFILE,
+  EVENT_SNAPSHOT,
+  EVENT_IPI,
+  EVENT_LIMIT,
+  EVENT_COUNT
+};
+
+constexpr auto NEVER = ~0ull;
+
+// Why emulate() returned; the names are used in batch results
+enum EmulatorStop
+{
+  STOP_HALT,
+  STOP_INSTRUCTION_LIMIT,
+  STOP_TIMEOUT,
+  STOP_FAULT
+};
+
+constexpr const char *STOP_NAMES[] = {"halt", "instruction-limit", "timeout", "fault"};
+
+// Under a timeout the host clock is read this often
+constexpr auto LIMIT_POLL_INTERVAL = 100000ull;
+
+enum TraceLevel
+{
+  TRACE_NONE,
+  TRACE_BRANCHES,
+  TRACE_ALL
+};
+
+enum EmulatorCore
+{
+  CORE_SWITCH,  // per-class handlers from the decoded instruction cache
+  CORE_THREADED, // 256-entry opcode table, computed goto where supported
+  CORE_BLOCK     // basic blocks translated once into chains of closures
+};
+
+constexpr auto MAX_BLOCK_LENGTH = 64;
+
+constexpr auto TRACE_BUFFER_SIZE = 1 << 16;
+constexpr auto HEX_BUFFER_SIZE = 1 << 20; // linker hex output, flushed in chunks
+
+// Binary relocatable object: header, symbols, sections, relocations, strings, section data
+constexpr auto OBJECT_MAGIC = 0x4F535353; // "SSSO"
+constexpr auto OBJECT_VERSION = 1;
+
+// Incremental link cache: inputs with content hashes, placements, symbols, linked memory
+constexpr auto CACHE_MAGIC = 0x43535353; // "SSSC"
+constexpr auto CACHE_VERSION = 1;
+
+// Emulator snapshots: a chain of records, each a header followed by (page number, page) pairs;
+// the first record holds every page, later ones only pages written since the previous record
+constexpr auto SNAPSHOT_MAGIC = 0x50535353; // "SSSP"
+constexpr auto SNAPSHOT_VERSION = 1;
+constexpr auto SNAPSHOT_PERIOD = 10000000ull; // retired instructions between snapshots
+
+// Event log for record/replay: a header, then per asynchronous event the retired-instruction
+// delta to the previous event as a LEB128 varint, the event type and its data byte
+constexpr auto EVENTLOG_MAGIC = 0x52535353; // "SSSR"
+constexpr auto EVENTLOG_VERSION = 1;
+constexpr auto EVENTLOG_BUFFER_SIZE = 1 << 16;
+
+enum LoggedEvent : unsigned char
+{
+  LOGGED_TERMINAL // a terminal input byte, its interrupt raised at the same instruction
+};
+
+// Binary memory image: header, segment table, page-aligned segment data
+constexpr auto IMAGE_MAGIC = 0x4D495353; // "SSIM"
+constexpr auto IMAGE_VERSION = 1;
+
+// Guest memory: 4 GiB split as 10b table | 10b page | 12b offset
+constexpr auto PAGE_BITS = 12;
+constexpr auto PAGE_SIZE = 1u << PAGE_BITS;
+constexpr auto PAGE_MASK = PAGE_SIZE - 1;
+constexpr auto TABLE_BITS = 10;
+constexpr auto TABLE_SIZE = 1u << TABLE_BITS;
+
+// Literal pool entries must stay within a positive 12-bit displacement of their users
+constexpr auto POOL_REACH = 2047;
+
 constexpr uint8_t getByte(uint32_t value, int byteNum)
 {
   return (value >> (8 * byteNum)) & 0xFF;
@@ -97,6 +223,76 @@ public:
   unsigned int D;
 };
 
+class Emulator;
+typedef void (Emulator::*InstructionHandler)(Instruction &);
+
+class DecodedInstruction
+{
+public:
+  InstructionHandler handler = nullptr;
+  Instruction ins;
+  bool valid = false;
+  unsigned long long count = 0; // executions since ins was decoded, folded into the class counts lazily
+};
+
+// Lock-free ring for exactly one producer and one consumer thread
+class CharRing
+{
+private:
+  vector<char> data;
+  size_t mask;
+  atomic<size_t> head{0}; // advanced by the producer
+  atomic<size_t> tail{0}; // advanced by the consumer
+
+public:
+  CharRing(size_t capacity) : data(capacity), mask(capacity - 1) {}
+
+  bool push(char c)
+  {
+    const size_t h = head.load(memory_order_relaxed);
+    if (h - tail.load(memory_order_acquire) == data.size())
+      return false;
+    data[h & mask] = c;
+    head.store(h + 1, memory_order_release);
+    return true;
+  }
+
+  size_t pop(char *out, size_t max)
+  {
+    const size_t t = tail.load(memory_order_relaxed);
+    size_t n = head.load(memory_order_acquire) - t;
+    if (n > max)
+      n = max;
+    for (size_t i = 0; i < n; i++)
+      out[i] = data[(t + i) & mask];
+    tail.store(t + n, memory_order_release);
+    return n;
+  }
+};
+
+class ProfileNode // call tree of the guest profiler
+{
+public:
+  int parent;
+  unsigned int entry; // address the function was entered at
+  unsigned long long calls = 0;
+  unsigned long long samples = 0;
+  int lastChild = -1; // most call sites always call the same function
+};
+
+class EmulatorPage;
+
+class TranslatedBlock
+{
+public:
+  unsigned int start;
+  unsigned int end;
+  EmulatorPage *page; // blocks never cross pages
+  vector<function<void()>> ops;
+  vector<Instruction> code; // source instructions, kept for tracing and class counts
+  unsigned long long executions = 0; // complete runs, early exits are counted directly
+};
+
 class SymbolEntry
 {
 public:
@@ -123,6 +319,11 @@ public:
   vector<char> memory;
   vector<RelocationEntry> relocs;
   unsigned int baseAddress = 0;
+  int nameId = 0;             // interned name, linker only
+  const char *data = nullptr; // bytes inside a mapped binary object, memory is then empty
+
+  const char *bytes() const { return data ? data : memory.data(); }
+  size_t byteCount() const { return data ? size : memory.size(); }
 };
 
 class ForwardLinkEntry // backpatching
@@ -141,6 +342,21 @@ public:
   vector<SymbolEntry> symbolTable;
   vector<SectionEntry> sectionTable;
   int sectionCnt = 0;
+  shared_ptr<void> mapping; // keeps a mapped binary object alive
+};
+
+class PoolEntry
+{
+public:
+  string symbol; // empty for a literal
+  int value = 0;
+};
+
+class PoolReference
+{
+public:
+  int offset; // of the referencing instruction in its section
+  int entry;
 };
 
 class SectionPlace
@@ -150,6 +366,15 @@ public:
   unsigned baseAddress;
 };
 
+// One line of a batch manifest: an image, optionally with its own limits (0 keeps the batch-wide ones)
+class BatchJob
+{
+public:
+  string image;
+  unsigned long long maxInstructions = 0;
+  unsigned long long timeoutMs = 0;
+};
+
 class LinkerMemoryEntry
 {
 public:
@@ -158,11 +383,163 @@ public:
   unsigned int baseAddress = 0;
 };
 
-class EmulatorMemoryEntry
+class CachedReference
+{
+public:
+  string symbol;      // extern symbol the word was patched with
+  int memoryId = 0;   // index into the linked memory
+  unsigned int offset = 0;
+};
+
+class CachedObject
+{
+public:
+  string name;
+  uint64_t hash = 0;
+  vector<SectionEntry> sections; // name, size and baseAddress only
+  vector<string> globals;        // defined here, in symbol table order
+  vector<CachedReference> externRefs;
+};
+
+class LinkCache
+{
+public:
+  vector<SectionPlace> places;
+  vector<CachedObject> objects;
+  vector<LinkerMemoryEntry> memory;
+  vector<pair<string, int>> globals; // name -> resolved address
+};
+
+class ObjectHeader
 {
 public:
-  unsigned int address;
-  char value;
+  uint32_t magic = OBJECT_MAGIC;
+  uint32_t version = OBJECT_VERSION;
+  uint32_t symbolCnt = 0;
+  uint32_t symbolOffset = 0;
+  uint32_t sectionCnt = 0; // including UND at index 0
+  uint32_t sectionOffset = 0;
+  uint32_t relocCnt = 0;
+  uint32_t relocOffset = 0;
+  uint32_t stringSize = 0;
+  uint32_t stringOffset = 0;
+};
+
+class ObjectSymbol
+{
+public:
+  uint32_t name = 0; // offset into the string table
+  int32_t sectionId = 0;
+  int32_t offset = 0;
+  uint8_t isGlobal = 0;
+  uint8_t isSection = 0;
+  uint16_t reserved = 0;
+};
+
+class ObjectSection
+{
+public:
+  uint32_t name = 0; // offset into the string table
+  uint32_t size = 0;
+  uint32_t dataOffset = 0;
+  uint32_t firstReloc = 0;
+  uint32_t relocCnt = 0;
+};
+
+class ObjectReloc
+{
+public:
+  int32_t offset = 0;
+  int32_t symbolId = 0;
+  int32_t addend = 0;
+};
+
+class SnapshotHeader
+{
+public:
+  uint32_t magic = SNAPSHOT_MAGIC;
+  uint32_t version = SNAPSHOT_VERSION;
+  uint64_t retired = 0;
+  uint32_t regs[16] = {};
+  uint32_t csrRegs[3] = {};
+  uint32_t timerConfig = 0;
+  uint32_t pendingInterrupts = 0;
+  uint32_t pageCnt = 0;
+  uint64_t timerDelay = 0; // retired instructions left until the next timer interrupt
+};
+
+class EventLogHeader
+{
+public:
+  uint32_t magic = EVENTLOG_MAGIC;
+  uint32_t version = EVENTLOG_VERSION;
+  uint64_t retired = 0; // retired count the log starts at
+};
+
+class ImageHeader
+{
+public:
+  uint32_t magic = IMAGE_MAGIC;
+  uint32_t version = IMAGE_VERSION;
+  uint32_t segmentCnt = 0;
+  uint32_t reserved = 0;
+};
+
+class ImageSegment
+{
+public:
+  uint32_t baseAddress = 0; // page-aligned
+  uint32_t size = 0;        // multiple of PAGE_SIZE
+  uint32_t fileOffset = 0;  // page-aligned
+  uint32_t reserved = 0;
+};
+
+class EmulatorDecodedPage
+{
+public:
+  DecodedInstruction entries[PAGE_SIZE / 4];
+};
+
+// Caches are per cpu; a cpu drops exactly what its own stores overlap, and the whole
+// page once it sees the generation another cpu bumped by storing into it
+class EmulatorPage
+{
+public:
+  unsigned char *bytes = nullptr;      // points into storage or into a mapped image
+  unique_ptr<unsigned char[]> storage; // empty for pages of a mapped image
+  unique_ptr<EmulatorDecodedPage> decoded[MAX_CPUS]; // allocated once a cpu fetches code from the page
+  bool translated[MAX_CPUS] = {};                    // some block a cpu translated starts in this page
+  atomic<bool> dirty{false};                         // written since the last snapshot
+  atomic<bool> hasCode{false};                       // some cpu cached code from the page
+  atomic<unsigned int> generation{0};                // bumped by stores once the page has code
+  unsigned int seen[MAX_CPUS] = {};                  // generation each cpu's caches are up to
+};
+
+// Entries are published once, with release, and never replaced while the emulator runs
+class EmulatorPageTable
+{
+public:
+  atomic<EmulatorPage *> pages[TABLE_SIZE] = {};
+
+  ~EmulatorPageTable()
+  {
+    for (auto &page : pages)
+      delete page.load();
+  }
+};
+
+// Guest memory shared by every cpu, lookups are lock-free
+class EmulatorMemory
+{
+public:
+  atomic<EmulatorPageTable *> tables[TABLE_SIZE] = {};
+  mutex allocation; // serializes first touches
+
+  ~EmulatorMemory()
+  {
+    for (auto &table : tables)
+      delete table.load();
+  }
 };
 
 template <typename Stream>
@@ -202,10 +579,11 @@ void printSections(Stream &output, vector<SectionEntry> &table)
       continue; // Skip empty sections and the section named "UND"
 
     output << "#." << section.name << endl;
+    const char *bytes = section.bytes();
     int j = 0;
-    for (const auto &content : section.memory)
+    for (size_t i = 0; i < section.byteCount(); i++)
     {
-      output << setw(2) << setfill('0') << right << hex << static_cast<int>(static_cast<unsigned char>(content)) << " ";
+      output << setw(2) << setfill('0') << right << hex << static_cast<int>(static_cast<unsigned char>(bytes[i])) << " ";
       if (++j % LINE_BREAK == 0)
         output << "\n";
     }
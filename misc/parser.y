@@ -4,18 +4,33 @@
   #include <iostream>
 
   using namespace std;
-  
-  extern int yylex();
-  extern char* yytext;
-  extern int yylineno;
-  void yyerror(const char *s);
-
-  Assembler* assembler;
 %}
 
+%code requires {
+  class Assembler;
+
+  #ifndef YY_TYPEDEF_YY_SCANNER_T
+  #define YY_TYPEDEF_YY_SCANNER_T
+  typedef void *yyscan_t;
+  #endif
+}
+
+%code {
+  // Reentrant scanner, see lexer.l
+  int yylex(YYSTYPE *, yyscan_t);
+  int yyget_lineno(yyscan_t);
+  char *yyget_text(yyscan_t);
+  void yyerror(yyscan_t, Assembler &, const char *);
+}
+
 %defines "./inc/parser.hpp"
 %output "./src/parser.cpp"
 
+// One parser per file, all state lives in the scanner and the assembler
+%define api.pure full
+%lex-param {yyscan_t scanner}
+%parse-param {yyscan_t scanner} {Assembler &assembler}
+
 %union {
   int intVal;
   char* strVal;
@@ -28,6 +43,7 @@
 %token <strVal> LABEL
 
 %token EOL
+%token UNKNOWN
 %token '+'
 %token ','
 %token '$'
@@ -40,6 +56,7 @@
 %token SECTION
 %token WORD
 %token SKIP
+%token LTORG
 %token END
 
 %token HALT
@@ -75,36 +92,37 @@
 
 %%
 input:
-  | line input
+  | line { if (assembler.hasFailed()) YYABORT; } input
 ;
 
 line:
-  EOL                  { yylineno++; }
-  | directive EOL      { yylineno++; }
-  | instructions EOL   { yylineno++; }
-  | LABEL EOL          { yylineno++; assembler->_label($1); }
-  | END EOL            { yylineno++; assembler->_end(); }
+  EOL
+  | directive EOL
+  | instructions EOL
+  | LABEL EOL          { assembler._label($1); }
+  | END EOL            { assembler._end(); }
 
 directive:
   GLOBAL globals {}
   | EXTERN externs {}
-  | SECTION SYMBOL          { assembler->_section($2); }
+  | SECTION SYMBOL          { assembler._section($2); }
   | WORD words
-  | SKIP NUMBER             { assembler->_skip($2); }
+  | SKIP NUMBER             { assembler._skip($2); }
+  | LTORG                   { assembler._ltorg(); }
 
 externs:
-  SYMBOL                    { assembler->_extern($1); }
-  | externs ',' SYMBOL      { assembler->_extern($3); }
+  SYMBOL                    { assembler._extern($1); }
+  | externs ',' SYMBOL      { assembler._extern($3); }
 
 globals:  
-  SYMBOL                    { assembler->_global($1); }
-  | globals ',' SYMBOL      { assembler->_global($3); }
+  SYMBOL                    { assembler._global($1); }
+  | globals ',' SYMBOL      { assembler._global($3); }
 
 words: 
-  SYMBOL                    { assembler->_word($1); }
-  | NUMBER                  { assembler->_word($1); }
-  | words ',' SYMBOL        { assembler->_word($3); }
-  | words  ',' NUMBER       { assembler->_word($3); }
+  SYMBOL                    { assembler._word($1); }
+  | NUMBER                  { assembler._word($1); }
+  | words ',' SYMBOL        { assembler._word($3); }
+  | words  ',' NUMBER       { assembler._word($3); }
 
 instructions:
   calls                     
@@ -118,69 +136,69 @@ instructions:
   | other                   
 
 calls:
-  CALL NUMBER         { assembler->_call($2); }          
-  | CALL SYMBOL       { assembler->_call($2); }
+  CALL NUMBER         { assembler._call($2); }          
+  | CALL SYMBOL       { assembler._call($2); }
 
 jmps:
-  JMP NUMBER          { assembler->_jmp($2); }
-  | JMP SYMBOL        { assembler->_jmp($2); }
+  JMP NUMBER          { assembler._jmp($2); }
+  | JMP SYMBOL        { assembler._jmp($2); }
 
 beqs:
-  BEQ '%' GPR ',' '%' GPR ',' NUMBER        { assembler->_beq($3, $6, $8); }
-  | BEQ '%' GPR ',' '%' GPR ',' SYMBOL      { assembler->_beq($3, $6, $8); }
+  BEQ '%' GPR ',' '%' GPR ',' NUMBER        { assembler._beq($3, $6, $8); }
+  | BEQ '%' GPR ',' '%' GPR ',' SYMBOL      { assembler._beq($3, $6, $8); }
 
 bnes:
-  BNE '%' GPR ',' '%' GPR ',' NUMBER        { assembler->_bne($3, $6, $8); }
-  | BNE '%' GPR ',' '%' GPR ',' SYMBOL      { assembler->_bne($3, $6, $8); }
+  BNE '%' GPR ',' '%' GPR ',' NUMBER        { assembler._bne($3, $6, $8); }
+  | BNE '%' GPR ',' '%' GPR ',' SYMBOL      { assembler._bne($3, $6, $8); }
 
 bgts:
-  BGT '%' GPR ',' '%' GPR ',' NUMBER        { assembler->_bgt($3, $6, $8); }
-  | BGT '%' GPR ',' '%' GPR ',' SYMBOL      { assembler->_bgt($3, $6, $8); }
+  BGT '%' GPR ',' '%' GPR ',' NUMBER        { assembler._bgt($3, $6, $8); }
+  | BGT '%' GPR ',' '%' GPR ',' SYMBOL      { assembler._bgt($3, $6, $8); }
 
 regs:
-  PUSH '%' GPR                    { assembler->_push($3); }
-  | POP '%' GPR                   { assembler->_pop($3); }
-  | XCHG '%' GPR ',' '%' GPR      { assembler->_xchg($3, $6); }
-  | ADD '%' GPR ',' '%' GPR       { assembler->_add($3, $6); }
-  | SUB '%' GPR ',' '%' GPR       { assembler->_sub($3, $6); }
-  | MUL '%' GPR ',' '%' GPR       { assembler->_mul($3, $6); }
-  | DIV '%' GPR ',' '%' GPR       { assembler->_div($3, $6); }
-  | NOT '%' GPR                   { assembler->_not($3); }
-  | AND '%' GPR ',' '%' GPR       { assembler->_and($3, $6); }
-  | OR '%' GPR ',' '%' GPR        { assembler->_or($3, $6); }
-  | XOR '%' GPR ',' '%' GPR       { assembler->_xor($3, $6); }
-  | SHL '%' GPR ',' '%' GPR       { assembler->_shl($3, $6); }
-  | SHR '%' GPR ',' '%' GPR       { assembler->_shr($3, $6); }
-  | CSRRD CSR ',' '%' GPR         { assembler->_csrrd($2, $5); }
-  | CSRWR '%' GPR ',' CSR         { assembler->_csrwr($3, $5); }
+  PUSH '%' GPR                    { assembler._push($3); }
+  | POP '%' GPR                   { assembler._pop($3); }
+  | XCHG '%' GPR ',' '%' GPR      { assembler._xchg($3, $6); }
+  | ADD '%' GPR ',' '%' GPR       { assembler._add($3, $6); }
+  | SUB '%' GPR ',' '%' GPR       { assembler._sub($3, $6); }
+  | MUL '%' GPR ',' '%' GPR       { assembler._mul($3, $6); }
+  | DIV '%' GPR ',' '%' GPR       { assembler._div($3, $6); }
+  | NOT '%' GPR                   { assembler._not($3); }
+  | AND '%' GPR ',' '%' GPR       { assembler._and($3, $6); }
+  | OR '%' GPR ',' '%' GPR        { assembler._or($3, $6); }
+  | XOR '%' GPR ',' '%' GPR       { assembler._xor($3, $6); }
+  | SHL '%' GPR ',' '%' GPR       { assembler._shl($3, $6); }
+  | SHR '%' GPR ',' '%' GPR       { assembler._shr($3, $6); }
+  | CSRRD CSR ',' '%' GPR         { assembler._csrrd($2, $5); }
+  | CSRWR '%' GPR ',' CSR         { assembler._csrwr($3, $5); }
 
 lds:
-  LD '$' NUMBER ',' '%' GPR                       { assembler->_ldImm($3, $6); }
-  | LD '$' SYMBOL ',' '%' GPR                     { assembler->_ldImm($3, $6); }
-  | LD NUMBER ',' '%' GPR                         { assembler->_ldMemDir($2, $5); }
-  | LD SYMBOL ',' '%' GPR                         { assembler->_ldMemDir($2, $5); }
-  | LD '%' GPR ',' '%' GPR                        { assembler->_ldRegDir($3, $6); }
-  | LD '[' '%' GPR ']' ',' '%' GPR                { assembler->_ldRegInd($4, $8); }
-  | LD '[' '%' GPR '+' NUMBER ']' ',' '%' GPR     { assembler->_ldRegIndOff($4, $6, $10); }
-  | LD '[' '%' GPR '+' SYMBOL ']' ',' '%' GPR     { cout << "REG_IND_OFF can't work with SYMBOL" << endl; exit(-1); }
+  LD '$' NUMBER ',' '%' GPR                       { assembler._ldImm($3, $6); }
+  | LD '$' SYMBOL ',' '%' GPR                     { assembler._ldImm($3, $6); }
+  | LD NUMBER ',' '%' GPR                         { assembler._ldMemDir($2, $5); }
+  | LD SYMBOL ',' '%' GPR                         { assembler._ldMemDir($2, $5); }
+  | LD '%' GPR ',' '%' GPR                        { assembler._ldRegDir($3, $6); }
+  | LD '[' '%' GPR ']' ',' '%' GPR                { assembler._ldRegInd($4, $8); }
+  | LD '[' '%' GPR '+' NUMBER ']' ',' '%' GPR     { assembler._ldRegIndOff($4, $6, $10); }
+  | LD '[' '%' GPR '+' SYMBOL ']' ',' '%' GPR     { assembler.error("REG_IND_OFF can't work with SYMBOL"); YYABORT; }
 
 sts:
-  ST '%' GPR ',' '$' NUMBER                       { cout << "STORE can't work with IMMEDIATE"; exit(-1); }
-  | ST '%' GPR ',' '$' SYMBOL                     { cout << "STORE can't work with IMMEDIATE"; exit(-1); }
-  | ST '%' GPR ',' NUMBER                         { assembler->_stMemDir($3, $5); }
-  | ST '%' GPR ',' SYMBOL                         { assembler->_stMemDir($3, $5); }
-  | ST '%' GPR ',' '%' GPR                        { cout << "REG_DIR can't work with REG"; exit(-1); }
-  | ST '%' GPR ',' '[' '%' GPR ']'                { assembler->_stRegInd($3, $7); }
-  | ST '%' GPR ',' '[' '%' GPR '+' NUMBER ']'     { assembler->_stRegIndOff($3, $7, $9); }
-  | ST '%' GPR ',' '[' '%' GPR '+' SYMBOL ']'     { cout << "REG_IND_OFF can't work with SYMBOL" << endl; exit(-1); } 
+  ST '%' GPR ',' '$' NUMBER                       { assembler.error("STORE can't work with IMMEDIATE"); YYABORT; }
+  | ST '%' GPR ',' '$' SYMBOL                     { assembler.error("STORE can't work with IMMEDIATE"); YYABORT; }
+  | ST '%' GPR ',' NUMBER                         { assembler._stMemDir($3, $5); }
+  | ST '%' GPR ',' SYMBOL                         { assembler._stMemDir($3, $5); }
+  | ST '%' GPR ',' '%' GPR                        { assembler.error("REG_DIR can't work with REG"); YYABORT; }
+  | ST '%' GPR ',' '[' '%' GPR ']'                { assembler._stRegInd($3, $7); }
+  | ST '%' GPR ',' '[' '%' GPR '+' NUMBER ']'     { assembler._stRegIndOff($3, $7, $9); }
+  | ST '%' GPR ',' '[' '%' GPR '+' SYMBOL ']'     { assembler.error("REG_IND_OFF can't work with SYMBOL"); YYABORT; } 
 
 other:
-  IRET                      { assembler->_iret(); }
-  | HALT                    { assembler->_halt(); }
-  | INT                     { assembler->_int(); }
-  | RET                     { assembler->_ret(); }
+  IRET                      { assembler._iret(); }
+  | HALT                    { assembler._halt(); }
+  | INT                     { assembler._int(); }
+  | RET                     { assembler._ret(); }
 %%
 
-void yyerror(const char *str) {
-  cout << "Syntax error (line " << yylineno << "): "<< "'" << yytext << "'" << endl;
+void yyerror(yyscan_t scanner, Assembler &assembler, const char *) {
+  assembler.error("Syntax error (line " + to_string(yyget_lineno(scanner)) + "): '" + yyget_text(scanner) + "'");
 }
\ No newline at end of file
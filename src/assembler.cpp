@@ -1,6 +1,6 @@
 #include "../inc/assembler.hpp"
-#include "../inc/lexer.hpp"
 #include "../inc/parser.hpp"
+#include "../inc/lexer.hpp"
 #include "../inc/util.hpp"
 
 #include <iostream>
@@ -8,53 +8,146 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <limits>
+#include <thread>
+#include <sys/stat.h>
 
 using namespace std;
 
+#ifndef DRIVER
+// Assembles one source into one object, everything it touches is local to the call
+bool assembleFile(const string &inputFileName, const string &outputName, bool text, bool optimize, string &messages)
+{
+  Assembler assembler;
+  if (!assembler.assemble(inputFileName, optimize))
+  {
+    messages = assembler.getMessages();
+    return false;
+  }
+
+  ofstream outputFile(outputName, text ? ios::out : ios::binary);
+  if (!outputFile)
+  {
+    messages = assembler.getMessages() + "ERROR | Failed to open the file: " + outputName + "\n";
+    return false;
+  }
+  text ? assembler.printOutput(outputFile) : assembler.writeObject(outputFile);
+  messages = assembler.getMessages();
+  return true;
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 4 || string(argv[1]) != "-o")
+  // -text keeps the human-readable object format, -O enables the peephole pass
+  bool text = false, optimize = false;
+  int arg = 1;
+  for (; arg < argc && string(argv[arg]) != "-o"; arg++)
+  {
+    string option = argv[arg];
+    if (option == "-text")
+      text = true;
+    else if (option == "-O")
+      optimize = true;
+    else
+      break;
+  }
+
+  if (argc - arg < 3 || string(argv[arg]) != "-o")
   {
     cout << "ERROR: Bad arguments" << endl;
     return -1;
   }
 
-  string inputFileName = "tests/" + string(argv[3]);
-  FILE *inputFile = fopen(inputFileName.c_str(), "r");
-  if (!inputFile)
+  // An existing directory, or any -o given several inputs, gets one <name>.o per source;
+  // otherwise -o names the output file of the single input
+  string output = argv[arg + 1];
+  vector<string> inputs(argv + arg + 2, argv + argc);
+  struct stat st;
+  bool directory = inputs.size() > 1 || (stat(output.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+  vector<string> outputs;
+  for (const auto &input : inputs)
   {
-    cout << "ERROR: Input file can't be opened" << endl;
-    return -1;
+    if (!directory)
+    {
+      outputs.push_back(output);
+      continue;
+    }
+    string name = input.substr(input.find_last_of('/') + 1);
+    outputs.push_back(output + "/" + name.substr(0, name.find_last_of('.')) + ".o");
   }
 
-  extern Assembler *assembler;
-  assembler = new Assembler();
+  // Sources are assembled on a pool of threads, messages are printed in command-line order
+  vector<string> messages(inputs.size());
+  vector<char> assembled(inputs.size(), false);
+  atomic<size_t> next(0);
 
-  assembler->init(inputFileName);
-  yyin = inputFile;
-  yyparse();
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < inputs.size(); i = next++)
+      assembled[i] = assembleFile("tests/" + inputs[i], outputs[i], text, optimize, messages[i]);
+  };
 
-  string outputName = argv[2];
-  ofstream outputFile(outputName);
-  if (!outputFile)
+  size_t threadCnt = min<size_t>(max(1u, thread::hardware_concurrency()), inputs.size());
+  vector<thread> pool;
+  for (size_t i = 1; i < threadCnt; i++)
+    pool.emplace_back(worker);
+  worker();
+  for (auto &t : pool)
+    t.join();
+
+  bool failed = false;
+  for (size_t i = 0; i < inputs.size(); i++)
   {
-    cout << "ERROR | Failed to open the file: " << outputName << endl;
-    return -1;
+    cout << messages[i];
+    failed = failed || !assembled[i];
+  }
+
+  return failed ? -1 : 0;
+}
+#endif
+
+bool Assembler::assemble(string str, bool opt)
+{
+  FILE *inputFile = fopen(str.c_str(), "r");
+  if (!inputFile)
+  {
+    messages << "ERROR: Input file can't be opened: " << str << endl;
+    return false;
   }
-  assembler->printOutput(outputFile);
 
-  return 0;
+  init(str, opt);
+
+  // Errors end only this file's parse, other files assembled alongside carry on
+  yyscan_t scanner;
+  yylex_init(&scanner);
+  yyset_in(inputFile, scanner);
+  const bool parsed = yyparse(scanner, *this) == 0;
+  yylex_destroy(scanner);
+  fclose(inputFile);
+  return parsed && !failed;
 }
 
-void Assembler::init(string str)
+void Assembler::init(string str, bool opt)
 {
   inputFileName = str;
+  optimize = opt;
   locationCounter = 0;
   currentSection = 0;
 
   sectionTable.push_back({"UND"});
 
-  cout << "ASSEMBLER | " << inputFileName << ": Start" << endl;
+  messages << "ASSEMBLER | " << inputFileName << ": Start" << endl;
+}
+
+void Assembler::error(const string &str)
+{
+  messages << "ERROR | " << inputFileName << ": " << str << endl;
+  failed = true;
+}
+
+string Assembler::getMessages()
+{
+  return messages.str();
 }
 
 void Assembler::printOutput(ofstream &os)
@@ -64,21 +157,70 @@ void Assembler::printOutput(ofstream &os)
   printRelocations(os, sectionTable);
 }
 
-int Assembler::getSymbolId(string str)
+void Assembler::writeObject(ofstream &os)
 {
-  for (int i = 0; i < symbolTable.size(); i++)
+  // Names go into one string table, NUL-terminated, referenced by offset
+  string strings(1, '\0');
+  auto addString = [&](const string &name)
   {
-    if (symbolTable[i].name == str)
-    {
-      return i;
-    }
+    uint32_t offset = strings.size();
+    strings += name;
+    strings += '\0';
+    return offset;
+  };
+
+  vector<ObjectSymbol> symbols;
+  for (const auto &symbol : symbolTable)
+    symbols.push_back({addString(symbol.name), symbol.sectionId, symbol.offset, symbol.isGlobal, symbol.isSection});
+
+  vector<ObjectSection> sections;
+  vector<ObjectReloc> relocs;
+  for (const auto &section : sectionTable)
+  {
+    sections.push_back({addString(section.name), static_cast<uint32_t>(section.memory.size()), 0, static_cast<uint32_t>(relocs.size()), static_cast<uint32_t>(section.relocs.size())});
+    for (const auto &reloc : section.relocs)
+      relocs.push_back({reloc.offset, reloc.symbolId, reloc.addend});
+  }
+
+  ObjectHeader header;
+  header.symbolCnt = symbols.size();
+  header.symbolOffset = sizeof(ObjectHeader);
+  header.sectionCnt = sections.size();
+  header.sectionOffset = header.symbolOffset + symbols.size() * sizeof(ObjectSymbol);
+  header.relocCnt = relocs.size();
+  header.relocOffset = header.sectionOffset + sections.size() * sizeof(ObjectSection);
+  header.stringSize = strings.size();
+  header.stringOffset = header.relocOffset + relocs.size() * sizeof(ObjectReloc);
+
+  // Section contents follow the tables, each one word aligned
+  uint32_t offset = (header.stringOffset + header.stringSize + 3) & ~3u;
+  for (auto &section : sections)
+  {
+    section.dataOffset = offset;
+    offset = (offset + section.size + 3) & ~3u;
   }
 
-  return -1;
+  os.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  os.write(reinterpret_cast<const char *>(symbols.data()), symbols.size() * sizeof(ObjectSymbol));
+  os.write(reinterpret_cast<const char *>(sections.data()), sections.size() * sizeof(ObjectSection));
+  os.write(reinterpret_cast<const char *>(relocs.data()), relocs.size() * sizeof(ObjectReloc));
+  os.write(strings.data(), strings.size());
+  for (size_t i = 0; i < sections.size(); i++)
+  {
+    os.seekp(sections[i].dataOffset);
+    os.write(sectionTable[i].memory.data(), sectionTable[i].memory.size());
+  }
+}
+
+int Assembler::getSymbolId(string str)
+{
+  auto it = symbolIds.find(str);
+  return it != symbolIds.end() ? it->second : -1;
 }
 
 int Assembler::addToSymbolTable(string str)
 {
+  symbolIds.emplace(str, symbolTable.size());
   symbolTable.push_back(SymbolEntry({str}));
 
   return symbolTable.size() - 1;
@@ -89,8 +231,7 @@ void Assembler::addToSectionRelocs(string str, int off)
   int symbolId = getSymbolId(str);
   if (symbolId == -1)
   {
-    cout << "ERROR | Symbol " << str << " is not in the table" << endl;
-    exit(-1);
+    error("Symbol " + str + " is not in the table");
   }
   else
   {
@@ -101,26 +242,297 @@ void Assembler::addToSectionRelocs(string str, int off)
 void Assembler::fillMemoryIncLc(char byte1, char byte2, char byte3, char byte4)
 {
   // cout << inputFileName << ": Filling memory " << hex << (int)byte1 << " " << (int)byte2 << " " << (int)byte3 << " " << (int)byte4 << endl;
+  reservePool(4);
+  appendWord(byte1, byte2, byte3, byte4, true);
+}
+
+void Assembler::appendWord(char byte1, char byte2, char byte3, char byte4, bool code)
+{
   vector<char> bytes = {byte1, byte2, byte3, byte4};
   sectionTable[currentSection].memory.insert(sectionTable[currentSection].memory.end(), bytes.begin(), bytes.end());
   locationCounter += 4; // instruction size = 4B
+  windowCode.push_back(code);
 }
 
-void Assembler::poolSymbol(char op, char mod, char a, char b, char c, string str)
+int Assembler::poolEntry(string str, int literal)
+{
+  // Entries are shared by every reference to the same symbol or value in the pool
+  if (str.empty())
+  {
+    auto it = poolLiterals.find(literal);
+    if (it != poolLiterals.end())
+      return it->second;
+    poolLiterals.emplace(literal, poolEntries.size());
+  }
+  else
+  {
+    auto it = poolSymbols.find(str);
+    if (it != poolSymbols.end())
+      return it->second;
+    poolSymbols.emplace(str, poolEntries.size());
+  }
+
+  poolEntries.push_back({str, literal});
+  return poolEntries.size() - 1;
+}
+
+void Assembler::reservePool(int size)
+{
+  // Dump the pool behind a jump once emitting size more bytes and one more entry
+  // could put its last entry out of reach of the oldest pending reference
+  if (poolRefs.empty())
+    return;
+
+  int lastEntry = locationCounter + size + 4 + 4 * poolEntries.size();
+  if (lastEntry - (poolRefs.front().offset + 4) > POOL_REACH)
+    placePool();
+}
+
+void Assembler::flushPool(bool jumpOver)
+{
+  peephole();
+  if (poolEntries.empty())
+  {
+    resetWindow();
+    return;
+  }
+
+  // Taken out first, emitting the pool must not trigger another flush
+  vector<PoolEntry> entries;
+  vector<PoolReference> refs;
+  entries.swap(poolEntries);
+  refs.swap(poolRefs);
+  poolSymbols.clear();
+  poolLiterals.clear();
+
+  int size = entries.size() * 4;
+  if (jumpOver)
+    fillMemoryIncLc(JUMP_OC | JMP_MOD0, PC_REG << 4, getByte(size, 1) & 0xF, size & 0xFF);
+
+  // Displacements are relative to the pc after fetching the referencing instruction
+  vector<char> &memory = sectionTable[currentSection].memory;
+  for (const auto &ref : refs)
+  {
+    int displacement = locationCounter + 4 * ref.entry - (ref.offset + 4);
+    memory[ref.offset + 2] = (memory[ref.offset + 2] & 0xF0) | getByte(displacement, 1);
+    memory[ref.offset + 3] = displacement & 0xFF;
+  }
+
+  for (const auto &entry : entries)
+  {
+    if (!entry.symbol.empty())
+    {
+      addToSectionRelocs(entry.symbol, locationCounter);
+      fillMemoryIncLc(0, 0, 0, 0); // placeholder
+    }
+    else
+    {
+      fillMemoryIncLc(getByte(entry.value, 0), getByte(entry.value, 1), getByte(entry.value, 2), getByte(entry.value, 3));
+    }
+  }
+  resetWindow();
+}
+
+bool Assembler::fallsThrough()
 {
-  for (auto &symbol : symbolTable)
+  // Whether execution can run past the last word emitted; data never does
+  if (windowCode.empty() || !windowCode.back())
+    return false;
+
+  const vector<char> &memory = sectionTable[currentSection].memory;
+  const unsigned char op = memory[locationCounter - 4];
+  const int a = (memory[locationCounter - 3] >> 4) & 0xF;
+  if (op == HALT_OC || op == (JUMP_OC | JMP_MOD0) || op == (JUMP_OC | JMP_MOD4))
+    return false;
+  // ret, iret and any other load of pc from a register or memory
+  return !(a == PC_REG && (op & 0xF0) == LOAD_OC && (op & 0xF) <= LOAD_MOD3);
+}
+
+void Assembler::placePool()
+{
+  // Labels just defined name what follows, not the pool or the jump over it
+  vector<int> labels;
+  if (!poolEntries.empty())
+    for (int id : windowLabels)
+      if (symbolTable[id].offset == locationCounter)
+        labels.push_back(id);
+
+  flushPool(fallsThrough());
+  for (int id : labels)
+  {
+    symbolTable[id].offset = locationCounter;
+    windowLabels.push_back(id);
+  }
+}
+
+void Assembler::flushPoolBeforeData()
+{
+  // The pool is never placed inside data, so a pending one goes in front of it;
+  // no instruction follows until the data ends, so no new entry can fall out of reach
+  if (!poolEntries.empty())
+    placePool();
+}
+
+void Assembler::resetWindow()
+{
+  windowStart = locationCounter;
+  windowCode.clear();
+  windowLabels.clear();
+  windowAligned = true;
+}
+
+void Assembler::peephole()
+{
+  int words = windowCode.size();
+  if (!optimize || !windowAligned || words < 2)
+    return;
+
+  vector<char> &memory = sectionTable[currentSection].memory;
+  auto field = [&](int i, int byte, int shift)
+  { return (memory[windowStart + 4 * i + byte] >> shift) & 0xF; };
+  auto displacement = [&](int i)
+  { return ((memory[windowStart + 4 * i + 2] & 0xF) << 8) | static_cast<unsigned char>(memory[windowStart + 4 * i + 3]); };
+  auto word = [&](int i)
+  { return string(&memory[windowStart + 4 * i], 4); };
+
+  // Words that labels point at, including the end of the window
+  vector<bool> target(words + 1, false);
+  for (int id : windowLabels)
+    target[(symbolTable[id].offset - windowStart) / 4] = true;
+
+  vector<int> refAt(words, -1);
+  for (int i = 0; i < poolRefs.size(); i++)
+    refAt[(poolRefs[i].offset - windowStart) / 4] = i;
+
+  // Any other pc-relative displacement could span removed words, leave such windows alone
+  for (int i = 0; i < words; i++)
+  {
+    if (!windowCode[i] || refAt[i] != -1 || displacement(i) == 0)
+      continue;
+
+    int op = memory[windowStart + 4 * i] & 0xF0;
+    bool basePc = field(i, 1, 0) == PC_REG || field(i, 2, 4) == PC_REG ||
+                  (field(i, 1, 4) == PC_REG && op != LOAD_OC);
+    if (basePc && (op == CALL_OC || op == JUMP_OC || op == LOAD_OC || op == STORE_OC))
+      return;
+  }
+
+  const char pushOp = STORE_OC | STORE_MOD2, popOp = LOAD_OC | LOAD_MOD3;
+  const char moveOp = LOAD_OC | LOAD_MOD1, poolLoadOp = LOAD_OC | LOAD_MOD2;
+  auto isPush = [&](int i)
+  { return memory[windowStart + 4 * i] == pushOp && field(i, 1, 4) == SP_REG && field(i, 1, 0) == 0 && displacement(i) == 0xFFC; };
+  auto isPop = [&](int i)
+  { return memory[windowStart + 4 * i] == popOp && field(i, 1, 0) == SP_REG && field(i, 2, 4) == 0 && displacement(i) == 4; };
+
+  // Loads whose result does not depend on the register they write, so repeating them changes nothing
+  auto isConstantLoad = [&](int i)
+  {
+    int a = field(i, 1, 4), b = field(i, 1, 0), c = field(i, 2, 4);
+    if (a == PC_REG || a == b || b == PC_REG)
+      return false;
+    if (memory[windowStart + 4 * i] == moveOp)
+      return refAt[i] == -1;
+    return memory[windowStart + 4 * i] == poolLoadOp && refAt[i] != -1 && a != c;
+  };
+
+  // Instructions that may still pair with the next one; labels and data end a run
+  vector<bool> removed(words, false);
+  vector<int> run;
+  for (int i = 0; i < words; i++)
   {
-    if (symbol.offset > locationCounter && symbol.sectionId == currentSection)
+    if (!windowCode[i] || target[i])
+      run.clear();
+    if (!windowCode[i])
+      continue;
+
+    // ld %rX, %rX
+    if (memory[windowStart + 4 * i] == moveOp && field(i, 1, 4) == field(i, 1, 0) && displacement(i) == 0)
     {
-      symbol.offset += 8; // 2 instructions
+      removed[i] = true;
+      continue;
     }
+
+    if (!run.empty())
+    {
+      int p = run.back();
+      int pushed = field(p, 2, 4), popped = field(i, 1, 4);
+      if (isPush(p) && isPop(i) && pushed != SP_REG && pushed != PC_REG && popped != SP_REG && popped != PC_REG)
+      {
+        removed[i] = true;
+        if (pushed == popped)
+        {
+          // push %rX; pop %rX
+          removed[p] = true;
+          run.pop_back();
+          if (target[p])
+            run.clear();
+        }
+        else
+        {
+          // push %rX; pop %rY => ld %rX, %rY
+          memory[windowStart + 4 * p] = moveOp;
+          memory[windowStart + 4 * p + 1] = (popped << 4) | pushed;
+          memory[windowStart + 4 * p + 2] = 0;
+          memory[windowStart + 4 * p + 3] = 0;
+        }
+        continue;
+      }
+
+      // Same constant loaded into the same register twice in a row
+      if (word(p) == word(i) && isConstantLoad(p) && isConstantLoad(i) &&
+          (refAt[i] == -1 || poolRefs[refAt[p]].entry == poolRefs[refAt[i]].entry))
+      {
+        removed[i] = true;
+        continue;
+      }
+    }
+    run.push_back(i);
+  }
+
+  // Compact the window and move everything that points into it
+  vector<int> newIndex(words + 1);
+  int kept = 0;
+  for (int i = 0; i < words; i++)
+  {
+    newIndex[i] = kept;
+    if (removed[i])
+      continue;
+    if (kept != i)
+      copy_n(memory.begin() + windowStart + 4 * i, 4, memory.begin() + windowStart + 4 * kept);
+    kept++;
   }
-  sectionTable[currentSection].size += 8; // 2 instructions
+  newIndex[words] = kept;
+  if (kept == words)
+    return;
 
-  fillMemoryIncLc(op | mod, (a << 4) | b, (c << 4) | getByte(complement2(4), 1), complement2(4) & 0xFF);
-  _jmp(4);
-  addToSectionRelocs(str, locationCounter);
-  fillMemoryIncLc(0, 0, 0, 0); // placeholder
+  auto move = [&](int offset)
+  { return windowStart + 4 * newIndex[(offset - windowStart) / 4]; };
+
+  for (int id : windowLabels)
+    symbolTable[id].offset = move(symbolTable[id].offset);
+
+  auto &relocs = sectionTable[currentSection].relocs;
+  for (auto it = relocs.rbegin(); it != relocs.rend() && it->offset >= windowStart; ++it)
+    it->offset = move(it->offset);
+
+  vector<PoolReference> refs;
+  for (const auto &ref : poolRefs)
+  {
+    if (!removed[(ref.offset - windowStart) / 4])
+      refs.push_back({move(ref.offset), ref.entry});
+  }
+  poolRefs.swap(refs);
+
+  memory.resize(windowStart + 4 * kept);
+  removedCnt += words - kept;
+  locationCounter = windowStart + 4 * kept;
+}
+
+void Assembler::poolSymbol(char op, char mod, char a, char b, char c, string str)
+{
+  // Displacement is patched in when the pool is flushed
+  fillMemoryIncLc(op | mod, (a << 4) | b, c << 4, 0);
+  poolRefs.push_back({locationCounter - 4, poolEntry(str, 0)});
 }
 
 bool Assembler::poolNeeded(int literal)
@@ -144,18 +556,8 @@ void Assembler::poolLiteral(int literal, vector<char> noPool, vector<char> pool)
 
   if (poolNeeded(literal))
   {
-    for (auto &symbol : symbolTable)
-    {
-      if (symbol.offset > locationCounter && symbol.sectionId == currentSection)
-      {
-        symbol.offset += 8; // 2 instructions
-      }
-    }
-    sectionTable[currentSection].size += 8; // 2 instructions
-
-    fillMemoryIncLc(op | mode, (A << 4) | B, (C << 4) | getByte(complement2(4), 1), complement2(4) & 0xFF);
-    _jmp(4);
-    fillMemoryIncLc(getByte(literal, 0), getByte(literal, 1), getByte(literal, 2), getByte(literal, 3));
+    fillMemoryIncLc(op | mode, (A << 4) | B, C << 4, 0);
+    poolRefs.push_back({locationCounter - 4, poolEntry("", literal)});
   }
   else
   {
@@ -182,9 +584,11 @@ void Assembler::_extern(string str)
 
 void Assembler::_section(string str)
 {
-  // If there is a current section, update its size
+  // If there is a current section, place its pool and update its size; code running off
+  // the end continues into the same section of the next object, so it jumps over the pool
   if (currentSection != 0)
   {
+    placePool();
     sectionTable[currentSection].size = locationCounter;
   }
 
@@ -192,10 +596,12 @@ void Assembler::_section(string str)
   locationCounter = 0;
   currentSection = sectionTable.size();
   sectionTable.push_back(SectionEntry({str}));
+  resetWindow();
 }
 
 void Assembler::_word(string str)
 {
+  flushPoolBeforeData();
   if (getSymbolId(str) == -1)
   {
     addToSymbolTable(str);
@@ -206,35 +612,50 @@ void Assembler::_word(string str)
     addToSectionRelocs(str, locationCounter);
   }
 
-  fillMemoryIncLc(0, 0, 0, 0);
+  appendWord(0, 0, 0, 0, false);
 }
 
 void Assembler::_word(int literal)
 {
-  fillMemoryIncLc(getByte(literal, 0), getByte(literal, 1), getByte(literal, 2), getByte(literal, 3));
+  flushPoolBeforeData();
+  appendWord(getByte(literal, 0), getByte(literal, 1), getByte(literal, 2), getByte(literal, 3), false);
 }
 
 void Assembler::_skip(int literal)
 {
+  flushPoolBeforeData();
   sectionTable[currentSection].memory.insert(sectionTable[currentSection].memory.end(), literal, 0);
   locationCounter += literal;
+  windowAligned = windowAligned && literal % 4 == 0;
+  windowCode.insert(windowCode.end(), literal / 4, false);
+}
+
+void Assembler::_ltorg()
+{
+  // Pool goes here, the code must not fall through into it
+  flushPool(false);
 }
 
 void Assembler::_end()
 {
   if (currentSection != 0)
   {
+    placePool();
     sectionTable[currentSection].size = locationCounter;
   }
 
-  // Put sections in symbol table
-  int add = 0;
-  for (int i = sectionTable.size() - 1; i >= 0; i--)
-  {
-    SymbolEntry entry = SymbolEntry({sectionTable[i].name, i, 0, false, true});
-    symbolTable.insert(symbolTable.begin(), entry);
-    add++;
-  }
+  // Put sections in front of the symbol table
+  int add = sectionTable.size();
+  vector<SymbolEntry> symbols;
+  symbols.reserve(add + symbolTable.size());
+  for (int i = 0; i < add; i++)
+    symbols.push_back(SymbolEntry({sectionTable[i].name, i, 0, false, true}));
+  symbols.insert(symbols.end(), make_move_iterator(symbolTable.begin()), make_move_iterator(symbolTable.end()));
+  symbolTable = move(symbols);
+
+  symbolIds.clear();
+  for (int i = 0; i < symbolTable.size(); i++)
+    symbolIds.emplace(symbolTable[i].name, i);
 
   // Update relocs
   for (auto &section : sectionTable)
@@ -246,7 +667,9 @@ void Assembler::_end()
   }
 
   locationCounter = 0;
-  cout << "ASSEMBLER | " << inputFileName << ": End" << endl;
+  if (optimize)
+    messages << "ASSEMBLER | " << inputFileName << ": Peephole removed " << removedCnt << " instructions" << endl;
+  messages << "ASSEMBLER | " << inputFileName << ": End" << endl;
 }
 
 void Assembler::_label(string str)
@@ -261,12 +684,13 @@ void Assembler::_label(string str)
   }
   else if (symbolTable[i].sectionId != 0)
   {
-    cout << "ERROR | Label " << name << " is already defined" << endl;
-    exit(-1);
+    error("Label " + name + " is already defined");
+    return;
   }
 
   symbolTable[i].offset = locationCounter;
   symbolTable[i].sectionId = currentSection;
+  windowLabels.push_back(i);
 }
 
 void Assembler::_halt()
@@ -505,8 +929,7 @@ void Assembler::_ldRegIndOff(int gprS, int literal, int gprD)
   // 
   if (poolNeeded(literal))
   {
-    cout << "ERROR | Literal can't fit into 12b" << endl;
-    exit(-1);
+    error("Literal can't fit into 12b");
   }
   else
   {
@@ -575,8 +998,7 @@ void Assembler::_stRegIndOff(int gprS, int gprD, int literal)
   // 
   if (poolNeeded(literal))
   {
-    cout << "ERROR | Literal can't fit into 12b" << endl;
-    exit(-1);
+    error("Literal can't fit into 12b");
   }
   else
   {
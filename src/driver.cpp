@@ -0,0 +1,90 @@
+#include "../inc/assembler.hpp"
+#include "../inc/linker.hpp"
+#include "../inc/emulator.hpp"
+#include "../inc/util.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Assembles, links and runs in one process, the stages hand their tables over in memory
+int main(int argc, char *argv[])
+{
+  cout << "DRIVER | Start" << endl;
+
+  bool optimize = false;
+  vector<SectionPlace> sectionPlaces;
+  vector<string> inputs;
+  Emulator emulator;
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    if (arg == "-O")
+      optimize = true;
+    else if (arg.rfind("-place=", 0) == 0)
+      sectionPlaces.push_back(Linker::parseSectionPlace(arg));
+    else if (emulator.parseOption(arg))
+      continue;
+    else if (arg[0] != '-')
+      inputs.push_back(arg);
+    else
+    {
+      cout << "ERROR: Bad arguments" << endl;
+      return -1;
+    }
+  }
+  if (inputs.empty())
+  {
+    cout << "ERROR: Bad arguments" << endl;
+    return -1;
+  }
+
+  // Assemble, each object goes straight into the linker's file table
+  Linker linker;
+  for (const auto &input : inputs)
+  {
+    Assembler assembler;
+    const bool assembled = assembler.assemble("tests/" + input, optimize);
+    cout << assembler.getMessages();
+    if (!assembled)
+      return -1;
+
+    FileEntry entry;
+    entry.name = input;
+    entry.symbolTable = move(assembler.getSymbolTable());
+    entry.sectionTable = move(assembler.getSectionTable());
+    entry.sectionCnt = entry.sectionTable.size() - 1; // UND section
+    linker.getFileEntries().push_back(move(entry));
+  }
+
+  // Link
+  linker.indexSections();
+  sort(sectionPlaces.begin(), sectionPlaces.end(), [](const SectionPlace &lhs, const SectionPlace &rhs)
+       { return lhs.baseAddress < rhs.baseAddress; });
+  sectionPlaces.empty() ? linker.fillMemory0() : linker.fillMemory(sectionPlaces);
+  linker.resolveSymbols();
+  linker.resolveRelocs();
+  cout << "DRIVER | Linked " << inputs.size() << " objects into " << linker.getLinkerMemory().size() << " sections" << endl;
+
+  // Run
+  emulator.loadSections(linker.getLinkerMemory());
+  emulator.initRegisters();
+  if (!emulator.restoreSnapshot())
+  {
+    cout << "ERROR | Cannot restore the snapshot!" << endl;
+    return -1;
+  }
+  emulator.initDevices();
+  emulator.emulate();
+
+  cout << "DRIVER | End" << endl;
+
+  emulator.printStats();
+  emulator.printCacheStats();
+  emulator.printOutput();
+
+  return 0;
+}
@@ -1,212 +1,2422 @@
 #include "../inc/emulator.hpp"
 
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 #include <iostream>
+#include <iterator>
 #include <fstream>
+#include <map>
 #include <string>
 using namespace std;
 
 Instruction PUSH_PC{STORE_OC | STORE_MOD2, SP_REG, 0, PC_REG, static_cast<unsigned int>(-4)};
 Instruction PUSH_STATUS{STORE_OC | STORE_MOD2, SP_REG, 0, STATUS_REG, static_cast<unsigned int>(-4)};
 
+// Aligned guest words are single host accesses, so no cpu ever sees another's store torn;
+// stores release and loads acquire. Guest memory is little-endian like the host.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "guest words are accessed in host order");
+
+static inline void storeWord(unsigned char *dst, unsigned int value)
+{
+  __atomic_store_n(reinterpret_cast<uint32_t *>(dst), value, __ATOMIC_RELEASE);
+}
+
+static inline unsigned int loadWord(const unsigned char *src)
+{
+  return __atomic_load_n(reinterpret_cast<const uint32_t *>(src), __ATOMIC_ACQUIRE);
+}
+
+#ifndef DRIVER
+// Options that only shape a run; the ones reading or writing files or the terminal
+// would be shared by every concurrent run, and traces would mix into the results
+static bool isBatchOption(const string &option)
+{
+  for (const char *prefix : {"--core=", "--cpus=", "--cpu-start=", "--max-instructions=", "--timeout="})
+    if (option.rfind(prefix, 0) == 0)
+      return true;
+  return option == "--trace=none";
+}
+
+static string runImage(const BatchJob &job, const vector<string> &options)
+{
+  // Every run gets a fresh emulator, only the process and the parsed options are shared
+  Emulator emulator;
+  emulator.setHeadless();
+  for (const auto &option : options)
+    emulator.parseOption(option);
+  emulator.setLimits(job.maxInstructions, job.timeoutMs);
+
+  if (emulator.loadImage(job.image))
+  {
+    emulator.initRegisters();
+    emulator.initDevices();
+    emulator.emulate();
+  }
+  else
+    emulator.fault("Cannot open input file!");
+
+  return emulator.getResult(job.image);
+}
+
+static int runBatch(const string &manifestName, const vector<string> &options, unsigned int threadCnt)
+{
+  ifstream manifest(manifestName);
+  if (!manifest)
+  {
+    cout << "ERROR | Cannot open batch manifest!" << endl;
+    return -1;
+  }
+
+  // "<image> [max-instructions [timeout-ms]]" per line, # starts a comment
+  vector<BatchJob> jobs;
+  string line;
+  while (getline(manifest, line))
+  {
+    istringstream fields(line.substr(0, line.find('#')));
+    BatchJob job;
+    if (!(fields >> job.image))
+      continue;
+    fields >> job.maxInstructions >> job.timeoutMs;
+    jobs.push_back(job);
+  }
+
+  // Threads pull the next image from a shared cursor, so a slow run never holds up the
+  // others; results are written in manifest order, each as soon as those before it are done
+  vector<string> results(jobs.size());
+  vector<char> done(jobs.size(), false);
+  size_t written = 0;
+  mutex output;
+  atomic<size_t> next(0);
+
+  auto worker = [&]()
+  {
+    for (size_t i = next++; i < jobs.size(); i = next++)
+    {
+      string result = runImage(jobs[i], options);
+
+      lock_guard<mutex> lock(output);
+      results[i] = move(result);
+      done[i] = true;
+      for (; written < jobs.size() && done[written]; written++)
+      {
+        cout << results[written] << '\n';
+        string().swap(results[written]);
+      }
+      cout.flush();
+    }
+  };
+
+  threadCnt = min<size_t>(threadCnt ? threadCnt : max(1u, thread::hardware_concurrency()), max<size_t>(jobs.size(), 1));
+  vector<thread> pool;
+  for (size_t i = 1; i < threadCnt; i++)
+    pool.emplace_back(worker);
+  worker();
+  for (auto &t : pool)
+    t.join();
+
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
-  cout << "EMULATOR | Start" << endl;
+  Emulator emulator;
+  string inputName;
+  string manifestName;
+  unsigned int threadCnt = 0;
+  vector<string> options;
+  const bool batch = any_of(argv + 1, argv + argc, [](const char *arg)
+                            { return string(arg).rfind("--batch=", 0) == 0; });
+  for (int i = 1; i < argc; i++)
+  {
+    string arg = argv[i];
+    if (arg.rfind("--batch=", 0) == 0)
+      manifestName = arg.substr(8);
+    else if (arg.rfind("--jobs=", 0) == 0)
+      threadCnt = stoul(arg.substr(7));
+    else if (batch && arg[0] == '-' && !isBatchOption(arg))
+    {
+      // Checked before parsing, which already opens files
+      cout << "ERROR | " << arg << " is not supported in batch mode!" << endl;
+      exit(-1);
+    }
+    else if (emulator.parseOption(arg))
+      options.push_back(arg);
+    else if (inputName.empty() && arg[0] != '-')
+      inputName = arg;
+    else
+    {
+      cout << "ERROR: Bad arguments" << endl;
+      exit(-1);
+    }
+  }
+
+  // Batch mode: every manifest image runs headless, one JSON line of results each on stdout
+  if (!manifestName.empty())
+  {
+    if (!inputName.empty())
+    {
+      cout << "ERROR: Bad arguments" << endl;
+      exit(-1);
+    }
+    return runBatch(manifestName, options, threadCnt);
+  }
 
-  if (argc != 2)
+  cout << "EMULATOR | Start" << endl;
+  if (inputName.empty() && !emulator.isRestoring())
   {
     cout << "ERROR: Bad arguments" << endl;
     exit(-1);
   }
 
-  ifstream inputFile(argv[1]);
-  if (!inputFile)
-  {
-    cout << "ERROR | Cannot open input file!" << endl;
-    exit(-1);
-  }
+  // A snapshot carries every page, the image is optional when restoring
+  if (!inputName.empty() && !emulator.loadImage(inputName))
+  {
+    cout << "ERROR | Cannot open input file!" << endl;
+    exit(-1);
+  }
+  emulator.initRegisters();
+  if (!emulator.restoreSnapshot())
+  {
+    cout << "ERROR | Cannot restore the snapshot!" << endl;
+    exit(-1);
+  }
+  emulator.initDevices();
+  emulator.emulate();
+
+  cout << "EMULATOR | End" << endl;
+
+  emulator.printStats();
+  emulator.printCacheStats();
+  emulator.printOutput();
+
+  return 0;
+}
+#endif
+
+static const char *mnemonic(unsigned char op)
+{
+  switch (op)
+  {
+  case HALT_OC:
+    return "halt";
+  case INT_OC:
+    return "int";
+  case CALL_OC | CALL_MOD0:
+    return "callMod0";
+  case CALL_OC | CALL_MOD1:
+    return "callMod1";
+  case JUMP_OC | JMP_MOD0:
+    return "jmpMod0";
+  case JUMP_OC | JMP_MOD1:
+    return "jmpMod1";
+  case JUMP_OC | JMP_MOD2:
+    return "jmpMod2";
+  case JUMP_OC | JMP_MOD3:
+    return "jmpMod3";
+  case JUMP_OC | JMP_MOD4:
+    return "jmpMod4";
+  case JUMP_OC | JMP_MOD5:
+    return "jmpMod5";
+  case JUMP_OC | JMP_MOD6:
+    return "jmpMod6";
+  case JUMP_OC | JMP_MOD7:
+    return "jmpMod7";
+  case XCHG_OC:
+    return "xchg";
+  case ARIT_OC | ADD_MOD:
+    return "add";
+  case ARIT_OC | SUB_MOD:
+    return "sub";
+  case ARIT_OC | MUL_MOD:
+    return "mul";
+  case ARIT_OC | DIV_MOD:
+    return "div";
+  case LOGIC_OC | NOT_MOD:
+    return "not";
+  case LOGIC_OC | AND_MOD:
+    return "and";
+  case LOGIC_OC | OR_MOD:
+    return "or";
+  case LOGIC_OC | XOR_MOD:
+    return "xor";
+  case SHIFT_OC | SHL_MOD:
+    return "shl";
+  case SHIFT_OC | SHR_MOD:
+    return "shr";
+  case STORE_OC | STORE_MOD0:
+    return "storeMod0";
+  case STORE_OC | STORE_MOD1:
+    return "storeMod1";
+  case STORE_OC | STORE_MOD2:
+    return "storeMod2";
+  case LOAD_OC | LOAD_MOD0:
+    return "loadMod0";
+  case LOAD_OC | LOAD_MOD1:
+    return "loadMod1";
+  case LOAD_OC | LOAD_MOD2:
+    return "loadMod2";
+  case LOAD_OC | LOAD_MOD3:
+    return "loadMod3";
+  case LOAD_OC | LOAD_MOD4:
+    return "loadMod4";
+  case LOAD_OC | LOAD_MOD5:
+    return "loadMod5";
+  case LOAD_OC | LOAD_MOD6:
+    return "loadMod6";
+  case LOAD_OC | LOAD_MOD7:
+    return "loadMod7";
+  }
+  return "invalid";
+}
+
+// Instructions that can redirect control flow (ret/iret are loads into pc)
+static bool isBranch(const Instruction &ins)
+{
+  switch (ins.op & 0xF0)
+  {
+  case HALT_OC:
+  case INT_OC:
+  case CALL_OC:
+  case JUMP_OC:
+    return true;
+  case LOAD_OC:
+    return ins.A == PC_REG && (ins.op == (LOAD_OC | LOAD_MOD1) || ins.op == (LOAD_OC | LOAD_MOD2) || ins.op == (LOAD_OC | LOAD_MOD3));
+  }
+  return false;
+}
+
+static struct termios savedTermios;
+
+static void restoreTermios()
+{
+  tcsetattr(STDIN_FILENO, TCSANOW, &savedTermios);
+}
+
+bool Terminal::openInput(string name)
+{
+  inputFd = open(name.c_str(), O_RDONLY);
+  ownsInput = inputFd >= 0;
+  return ownsInput;
+}
+
+void Terminal::start(bool withInput)
+{
+  if (capturing)
+    return;
+
+  // A replayed run takes its input from the event log, the terminal then only writes
+  if (!withInput)
+  {
+    if (ownsInput && inputFd >= 0)
+      close(inputFd);
+    inputFd = -1;
+    ownsInput = false;
+  }
+  // Without an input file an interactive stdin is used, switched to raw mode
+  else if (inputFd < 0 && isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, &savedTermios) == 0)
+  {
+    struct termios raw = savedTermios;
+    raw.c_lflag &= ~(ICANON | ECHO);
+    raw.c_cc[VMIN] = 0;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+    atexit(restoreTermios);
+    inputFd = STDIN_FILENO;
+  }
+
+  running.store(true, memory_order_release);
+  worker = thread(&Terminal::run, this);
+}
+
+void Terminal::stop()
+{
+  if (!worker.joinable())
+    return;
+
+  running.store(false, memory_order_release);
+  worker.join();
+  if (ownsInput && inputFd >= 0)
+    close(inputFd);
+  inputFd = -1;
+}
+
+void Terminal::write(char c)
+{
+  // Only spins, never blocks in a syscall, if the I/O thread falls a whole ring behind
+  lock_guard<mutex> lock(writer);
+  if (capturing)
+  {
+    captured += c;
+    return;
+  }
+  while (!output.push(c))
+    ;
+}
+
+bool Terminal::read(char &c)
+{
+  return input.pop(&c, 1) == 1;
+}
+
+void Terminal::run()
+{
+  char chunk[4096];
+  char pending[4096]; // input read but not yet taken by the ring
+  size_t pendingAt = 0, pendingEnd = 0;
+  int fd = inputFd;
+  for (;;)
+  {
+    // Output queued before a stop request is still written out
+    const bool stopping = !running.load(memory_order_acquire);
+
+    size_t n;
+    while ((n = output.pop(chunk, sizeof(chunk))) > 0)
+    {
+      size_t done = 0;
+      while (done < n)
+      {
+        ssize_t w = ::write(STDOUT_FILENO, chunk + done, n - done);
+        if (w <= 0)
+          break;
+        done += w;
+      }
+    }
+
+    if (stopping)
+      break;
+
+    while (pendingAt < pendingEnd && input.push(pending[pendingAt]))
+      pendingAt++;
+
+    // Wait up to 1 ms for input, which also paces the output draining;
+    // the fd is left alone while the ring is too full for what was read
+    const bool reading = fd >= 0 && pendingAt == pendingEnd;
+    struct pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, reading ? 1 : 0, 1) > 0)
+    {
+      ssize_t r = ::read(fd, pending, sizeof(pending));
+      if (r <= 0)
+      {
+        fd = -1; // end of input
+        continue;
+      }
+      pendingAt = 0;
+      pendingEnd = r;
+      while (pendingAt < pendingEnd && input.push(pending[pendingAt]))
+        pendingAt++;
+    }
+  }
+}
+
+bool TraceSink::open(string name)
+{
+  flush();
+  file.open(name);
+  fileName = name;
+  output = &file;
+  return file.is_open();
+}
+
+void TraceSink::write(unsigned int sp, unsigned int pc, const char *name)
+{
+  char line[64];
+  int len = snprintf(line, sizeof(line), "SP=%x, PC=%x %s\n", sp, pc, name);
+  buffer.insert(buffer.end(), line, line + len);
+
+  if (buffer.size() >= TRACE_BUFFER_SIZE - sizeof(line))
+    flush();
+}
+
+void TraceSink::flush()
+{
+  if (buffer.empty())
+    return;
+
+  output->write(buffer.data(), buffer.size());
+  output->flush();
+  buffer.clear();
+}
+
+bool SnapshotWriter::open(string name, bool append)
+{
+  file.open(name, ios::binary | (append ? ios::app : ios::trunc));
+  return file.is_open();
+}
+
+void SnapshotWriter::write(vector<char> &record)
+{
+  // Waits only if the previous record is still being written
+  wait();
+  pending.swap(record);
+  worker = thread([this]()
+                  { file.write(pending.data(), pending.size()); file.flush(); });
+}
+
+void SnapshotWriter::wait()
+{
+  if (worker.joinable())
+    worker.join();
+}
+
+bool EventLog::openRecord(string name, unsigned long long start)
+{
+  file.open(name, ios::binary | ios::trunc);
+  if (!file)
+    return false;
+
+  EventLogHeader header;
+  header.retired = start;
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  buffer.reserve(EVENTLOG_BUFFER_SIZE);
+  last = start;
+  return true;
+}
+
+bool EventLog::openReplay(string name, unsigned long long start)
+{
+  ifstream in(name, ios::binary);
+  EventLogHeader header;
+  if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      header.magic != EVENTLOG_MAGIC || header.version != EVENTLOG_VERSION || header.retired != start)
+    return false;
+
+  // Logs are small, the whole one is kept in memory
+  buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+  last = start;
+  replaying = true;
+  return true;
+}
+
+void EventLog::record(unsigned long long when, LoggedEvent type, unsigned char value)
+{
+  unsigned long long delta = when - last;
+  last = when;
+  do
+  {
+    unsigned char byte = delta & 0x7F;
+    delta >>= 7;
+    buffer.push_back(delta ? byte | 0x80 : byte);
+  } while (delta);
+  buffer.push_back(type);
+  buffer.push_back(value);
+
+  if (buffer.size() >= EVENTLOG_BUFFER_SIZE - 12)
+    flush();
+}
+
+bool EventLog::next(unsigned long long &when, LoggedEvent &type, unsigned char &value)
+{
+  unsigned long long delta = 0;
+  for (int shift = 0;; shift += 7)
+  {
+    if (position >= buffer.size())
+      return false;
+    unsigned char byte = buffer[position++];
+    delta |= static_cast<unsigned long long>(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+      break;
+  }
+  if (position + 2 > buffer.size())
+    return false;
+
+  type = static_cast<LoggedEvent>(buffer[position++]);
+  value = buffer[position++];
+  when = last += delta;
+  return true;
+}
+
+void EventLog::flush()
+{
+  if (!file.is_open() || buffer.empty())
+    return;
+
+  file.write(reinterpret_cast<const char *>(buffer.data()), buffer.size());
+  file.flush();
+  buffer.clear();
+}
+
+bool Profiler::loadSymbols(string name)
+{
+  // "<hex address> <name>" per line, as written by the linker's -symbols
+  ifstream file(name);
+  if (!file)
+    return false;
+
+  string line;
+  while (getline(file, line))
+  {
+    stringstream ss(line);
+    string address, symbol;
+    if (ss >> address >> symbol)
+      symbols.push_back({static_cast<unsigned int>(stoul(address, nullptr, 16)), symbol});
+  }
+  sort(symbols.begin(), symbols.end());
+  return true;
+}
+
+string Profiler::symbolize(unsigned int address)
+{
+  // Nearest symbol at or below the address
+  auto it = upper_bound(symbols.begin(), symbols.end(), make_pair(address, string(1, '\x7f')));
+  if (it != symbols.begin())
+  {
+    --it;
+    if (it->first == address)
+      return it->second;
+    char offset[16];
+    snprintf(offset, sizeof(offset), "+0x%x", address - it->first);
+    return it->second + offset;
+  }
+
+  char hexAddress[16];
+  snprintf(hexAddress, sizeof(hexAddress), "0x%08x", address);
+  return hexAddress;
+}
+
+void Profiler::start(unsigned int pc)
+{
+  nodes.assign(1, {-1, pc});
+  children.clear();
+  stack.clear();
+  pcSamples.clear();
+  lastPage = ~0u;
+}
+
+void Profiler::call(unsigned int entry, unsigned int returnAddress)
+{
+  int parent = stack.empty() ? 0 : stack.back().first;
+  int child = nodes[parent].lastChild;
+  if (child == -1 || nodes[child].entry != entry)
+  {
+    auto it = children.emplace((static_cast<unsigned long long>(parent) << 32) | entry, nodes.size());
+    if (it.second)
+      nodes.push_back({parent, entry});
+    child = it.first->second;
+    nodes[parent].lastChild = child;
+  }
+
+  nodes[child].calls++;
+  stack.push_back({child, returnAddress});
+}
+
+void Profiler::ret(unsigned int pc)
+{
+  // A load into pc returns from the innermost call expecting that address, others are plain jumps
+  for (size_t i = stack.size(); i-- > 0;)
+  {
+    if (stack[i].second == pc)
+    {
+      stack.resize(i);
+      return;
+    }
+  }
+}
+
+void Profiler::count(unsigned int pc, unsigned long long n)
+{
+  if ((pc >> PAGE_BITS) != lastPage)
+  {
+    unique_ptr<unsigned long long[]> &counters = pcSamples[pc >> PAGE_BITS];
+    if (!counters)
+      counters.reset(new unsigned long long[PAGE_SIZE / 4]());
+    lastPage = pc >> PAGE_BITS;
+    lastCounters = counters.get();
+  }
+  lastCounters[(pc & PAGE_MASK) >> 2] += n;
+}
+
+void Profiler::countNode(int node, unsigned long long n)
+{
+  sampleCnt += n;
+  nodes[node].samples += n;
+}
+
+void Profiler::sample(unsigned int pc)
+{
+  count(pc, 1);
+  countNode(currentNode(), 1);
+}
+
+bool Profiler::write()
+{
+  // Flat profile per function, call graph and per pc counts
+  ofstream flat(outputName);
+  ofstream folded(outputName + ".folded");
+  if (!flat || !folded)
+    return false;
+
+  auto function = [&](unsigned int pc)
+  {
+    auto it = upper_bound(symbols.begin(), symbols.end(), make_pair(pc, string(1, '\x7f')));
+    return it == symbols.begin() ? symbolize(pc) : prev(it)->second;
+  };
+
+  // Samples are kept per word, unaligned pcs count towards the word they are in
+  vector<pair<unsigned int, unsigned long long>> pcRows;
+  for (const auto &page : pcSamples)
+  {
+    for (unsigned int i = 0; i < PAGE_SIZE / 4; i++)
+    {
+      if (page.second[i])
+        pcRows.push_back({(page.first << PAGE_BITS) | (i << 2), page.second[i]});
+    }
+  }
+  sort(pcRows.begin(), pcRows.end());
+
+  unordered_map<string, unsigned long long> functionSamples;
+  for (const auto &pc : pcRows)
+    functionSamples[function(pc.first)] += pc.second;
+  vector<pair<unsigned long long, string>> flatRows;
+  for (const auto &row : functionSamples)
+    flatRows.push_back({row.second, row.first});
+  sort(flatRows.rbegin(), flatRows.rend());
+
+  flat << "#.flat (" << sampleCnt << " samples, one every " << period << " instructions)" << endl
+       << left << setw(WIDTH) << "Samples" << setw(WIDTH) << "Percent" << "Function" << endl;
+  for (const auto &row : flatRows)
+    flat << left << setw(WIDTH) << row.first << setw(WIDTH) << fixed << setprecision(2) << 100.0 * row.first / sampleCnt << row.second << endl;
+
+  map<pair<string, string>, unsigned long long> edges;
+  for (size_t i = 1; i < nodes.size(); i++)
+    edges[{symbolize(nodes[nodes[i].parent].entry), symbolize(nodes[i].entry)}] += nodes[i].calls;
+  flat << endl
+       << "#.callgraph" << endl
+       << left << setw(WIDTH) << "Calls" << "Caller -> Callee" << endl;
+  for (const auto &edge : edges)
+    flat << left << setw(WIDTH) << edge.second << edge.first.first << " -> " << edge.first.second << endl;
+
+  flat << endl
+       << "#.pc" << endl
+       << left << setw(WIDTH) << "Address" << setw(WIDTH) << "Samples" << "Symbol" << endl;
+  for (const auto &row : pcRows)
+    flat << left << hex << setw(WIDTH) << row.first << dec << setw(WIDTH) << row.second << symbolize(row.first) << endl;
+
+  // One "root;caller;callee samples" line per call path, for flame graphs
+  for (size_t i = 0; i < nodes.size(); i++)
+  {
+    if (nodes[i].samples == 0)
+      continue;
+    vector<string> path;
+    for (int n = i; n != -1; n = nodes[n].parent)
+      path.push_back(symbolize(nodes[n].entry));
+    for (size_t j = path.size(); j-- > 0;)
+      folded << path[j] << (j ? ";" : " ");
+    folded << nodes[i].samples << "\n";
+  }
+
+  return static_cast<bool>(flat) && static_cast<bool>(folded);
+}
+
+Emulator::Emulator(Emulator &boot, unsigned int id)
+    : memory(boot.memory), cpuId(id), cpuCnt(boot.cpuCnt), machine(&boot),
+      maxInstructions(boot.maxInstructions), timeoutMs(boot.timeoutMs), deadline(boot.deadline),
+      headless(boot.headless), core(boot.core), traceLevel(boot.traceLevel)
+{
+  // Every cpu traces to its own file next to cpu 0's
+  if (traceLevel != TRACE_NONE && !trace.open(boot.trace.getFileName() + ".cpu" + to_string(id)))
+  {
+    cout << "ERROR | Cannot open trace file!" << endl;
+    exit(-1);
+  }
+}
+
+Emulator::~Emulator()
+{
+  for (const auto &image : mappedImages)
+    munmap(image.first, image.second);
+}
+
+bool Emulator::parseOption(const string &arg)
+{
+  if (arg == "--core=switch")
+    setCore(CORE_SWITCH);
+  else if (arg == "--core=threaded")
+    setCore(CORE_THREADED);
+  else if (arg == "--core=block")
+    setCore(CORE_BLOCK);
+  else if (arg == "--trace=none")
+    setTrace(TRACE_NONE);
+  else if (arg == "--trace=branches")
+    setTrace(TRACE_BRANCHES);
+  else if (arg == "--trace=all")
+    setTrace(TRACE_ALL);
+  else if (arg.rfind("--term-in=", 0) == 0)
+  {
+    if (!terminal.openInput(arg.substr(10)))
+    {
+      cout << "ERROR | Cannot open terminal input file!" << endl;
+      exit(-1);
+    }
+  }
+  else if (arg.rfind("--profile=", 0) == 0)
+  {
+    profiling = true;
+    profiler.open(arg.substr(10));
+  }
+  else if (arg.rfind("--profile-period=", 0) == 0)
+    profiler.setPeriod(stoull(arg.substr(17)));
+  else if (arg.rfind("--symbols=", 0) == 0)
+  {
+    if (!profiler.loadSymbols(arg.substr(10)))
+    {
+      cout << "ERROR | Cannot open symbol map!" << endl;
+      exit(-1);
+    }
+  }
+  else if (arg.rfind("--snapshot=", 0) == 0)
+    snapshotName = arg.substr(11);
+  else if (arg.rfind("--snapshot-every=", 0) == 0)
+    snapshotPeriod = max(1ull, stoull(arg.substr(17)));
+  else if (arg.rfind("--restore=", 0) == 0)
+    restoreName = arg.substr(10);
+  else if (arg.rfind("--cpus=", 0) == 0)
+  {
+    cpuCnt = stoul(arg.substr(7));
+    if (cpuCnt < 1 || cpuCnt > MAX_CPUS)
+    {
+      cout << "ERROR | Between 1 and " << MAX_CPUS << " cpus are supported!" << endl;
+      exit(-1);
+    }
+  }
+  else if (arg.rfind("--cpu-start=", 0) == 0)
+  {
+    // Comma-separated start addresses, cpu 0 first
+    stringstream list(arg.substr(12));
+    string address;
+    while (getline(list, address, ','))
+      cpuStarts.push_back(stoul(address, nullptr, 0));
+  }
+  else if (arg.rfind("--max-instructions=", 0) == 0)
+    setLimits(stoull(arg.substr(19)), 0);
+  else if (arg.rfind("--timeout=", 0) == 0)
+    setLimits(0, stoull(arg.substr(10)));
+  else if (arg.rfind("--record=", 0) == 0)
+    recordName = arg.substr(9);
+  else if (arg.rfind("--replay=", 0) == 0)
+    replayName = arg.substr(9);
+  else if (arg.rfind("--trace-file=", 0) == 0)
+  {
+    if (!trace.open(arg.substr(13)))
+    {
+      cout << "ERROR | Cannot open trace file!" << endl;
+      exit(-1);
+    }
+  }
+  else
+    return false;
+
+  return true;
+}
+
+void Emulator::setHeadless()
+{
+  headless = true;
+  terminal.capture();
+}
+
+void Emulator::setLimits(unsigned long long instructions, unsigned long long ms)
+{
+  // 0 leaves a limit as it was
+  if (instructions)
+    maxInstructions = instructions;
+  if (ms)
+    timeoutMs = ms;
+}
+
+bool Emulator::loadImage(string name)
+{
+  // Binary images are recognized by their magic, anything else is read as hex text
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  ImageHeader header;
+  if (fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.magic == IMAGE_MAGIC)
+  {
+    bool loaded = loadBinary(fd, st.st_size);
+    close(fd);
+    if (!loaded)
+      fault("Malformed binary image");
+    return loaded;
+  }
+  close(fd);
+
+  ifstream inputFile(name);
+  if (!inputFile)
+    return false;
+
+  loadMemory(inputFile);
+  return true;
+}
+
+bool Emulator::loadBinary(int fd, size_t size)
+{
+  // Private writable mapping: guest stores copy the touched host page, the file is never written
+  void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+  mappedImages.push_back({map, size});
+
+  unsigned char *image = static_cast<unsigned char *>(map);
+  const ImageHeader *header = reinterpret_cast<const ImageHeader *>(image);
+  if (header->version != IMAGE_VERSION || sizeof(ImageHeader) + header->segmentCnt * sizeof(ImageSegment) > size)
+    return false;
+
+  const ImageSegment *segments = reinterpret_cast<const ImageSegment *>(image + sizeof(ImageHeader));
+  for (uint32_t i = 0; i < header->segmentCnt; i++)
+  {
+    const ImageSegment &segment = segments[i];
+    if (((segment.baseAddress | segment.size | segment.fileOffset) & PAGE_MASK) != 0 ||
+        static_cast<uint64_t>(segment.baseAddress) + segment.size > (1ull << 32) ||
+        static_cast<size_t>(segment.fileOffset) + segment.size > size)
+      return false;
+
+    for (uint32_t off = 0; off < segment.size; off += PAGE_SIZE)
+    {
+      EmulatorPage *page = findPage(segment.baseAddress + off);
+      if (page)
+      {
+        // Page already populated, fall back to copying
+        memcpy(page->bytes, image + segment.fileOffset + off, PAGE_SIZE);
+        continue;
+      }
+      mapPage(segment.baseAddress + off, image + segment.fileOffset + off);
+    }
+  }
+  return true;
+}
+
+void Emulator::loadMemory(ifstream &inputFile)
+{
+  string line;
+  while (getline(inputFile, line))
+  {
+    const unsigned int address = stoul(line.substr(0, 8), nullptr, 16);
+    unsigned int cursor = 10;
+
+    for (int i = 0; i < 8; i++)
+    {
+      const unsigned char value = static_cast<unsigned char>(stoul(line.substr(cursor, 2), nullptr, 16));
+
+      addByte(address + i, value);
+      cursor += 3;
+    }
+  }
+  inputFile.close();
+}
+
+void Emulator::loadSections(const vector<LinkerMemoryEntry> &sections)
+{
+  // Linked sections straight from the linker, copied a page at a time
+  for (const auto &section : sections)
+  {
+    unsigned int address = section.baseAddress;
+    size_t done = 0;
+    while (done < section.memory.size())
+    {
+      size_t chunk = min<size_t>(PAGE_SIZE - (address & PAGE_MASK), section.memory.size() - done);
+      memcpy(touchPage(address)->bytes + (address & PAGE_MASK), section.memory.data() + done, chunk);
+      address += chunk;
+      done += chunk;
+    }
+  }
+}
+
+void Emulator::initRegisters()
+{
+  // Initialize 15 regs with 0
+  regs.resize(15, 0);
+
+  // Initialize the program counter register with PC_START, or the cpu's own start
+  const vector<unsigned int> &starts = machine->cpuStarts;
+  regs.push_back(cpuId < starts.size() ? starts[cpuId] : PC_START);
+
+  // Initialize the CSR regs with 0, cpuid with the cpu index
+  csrRegs.resize(CSR_COUNT, 0);
+  csrRegs[CPUID_REG] = cpuId;
+}
+
+void Emulator::initDevices()
+{
+  for (auto &deadline : eventDeadlines)
+    deadline = NEVER;
+
+  // The timer runs from reset with tim_cfg = 0, or on from a restored snapshot
+  schedule(EVENT_TIMER, retired + (timerDelay ? timerDelay : TIMER_PERIODS_MS[timerConfig] * INSTRUCTIONS_PER_MS));
+  if (cpuCnt > 1)
+    schedule(EVENT_IPI, retired + IPI_POLL_INTERVAL);
+
+  // Limits stop every cpu through the same schedule, cpu 0 sets the deadline they share
+  if (timeoutMs && cpuId == 0)
+    deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs);
+  schedule(EVENT_LIMIT, nextLimitCheck());
+
+  // Every cpu has its own timer, the rest of the devices belong to cpu 0
+  if (cpuId != 0)
+    return;
+
+  // Those need one deterministic instruction stream
+  if (cpuCnt > 1 && !(snapshotName.empty() && restoreName.empty() && recordName.empty() && replayName.empty()))
+  {
+    cout << "ERROR | Snapshots and record/replay need a single cpu!" << endl;
+    exit(-1);
+  }
+  if (cpuCnt > 1 && traceLevel != TRACE_NONE && trace.getFileName().empty())
+  {
+    cout << "ERROR | Tracing several cpus needs --trace-file!" << endl;
+    exit(-1);
+  }
+
+  // Replay delivers terminal input at the logged instructions instead of polling
+  if (!replayName.empty() && !events.openReplay(replayName, retired))
+  {
+    cout << "ERROR | Cannot replay the event log!" << endl;
+    exit(-1);
+  }
+  if (!recordName.empty() && !events.isReplaying() && !events.openRecord(recordName, retired))
+  {
+    cout << "ERROR | Cannot open event log!" << endl;
+    exit(-1);
+  }
+
+  cout.flush();
+  terminal.start(!events.isReplaying());
+  if (events.isReplaying())
+    replayNext();
+  else if (terminal.hasInput())
+    eventDeadlines[EVENT_TERMINAL] = retired + TERMINAL_POLL_INTERVAL;
+  updateNextEvent();
+
+  // The profiler samples through the event schedule, the loops stay untouched; exact
+  // counts on the block core are kept per block instead, a sample every instruction
+  // would cut every block down to one
+  if (profiling)
+  {
+    profiler.start(regs[PC_REG]);
+    profileBlocks = core == CORE_BLOCK && profiler.getPeriod() == 1;
+    if (!profileBlocks)
+      schedule(EVENT_PROFILE, retired);
+  }
+
+  // Appending to the snapshot just restored continues its chain with deltas
+  if (!snapshotName.empty())
+  {
+    snapshotFull = snapshotName != restoreName;
+    if (!snapshots.open(snapshotName, !snapshotFull))
+    {
+      cout << "ERROR | Cannot open snapshot file!" << endl;
+      exit(-1);
+    }
+    schedule(EVENT_SNAPSHOT, retired + snapshotPeriod);
+  }
+
+  for (unsigned int id = 1; id < cpuCnt; id++)
+  {
+    cpus.emplace_back(new Emulator(*this, id));
+    cpus.back()->initRegisters();
+    cpus.back()->initDevices();
+  }
+
+  // Interrupts pending in a restored snapshot are delivered before its first instruction
+  retryInterrupts();
+}
+
+bool Emulator::restoreSnapshot()
+{
+  if (restoreName.empty())
+    return true;
+
+  ifstream file(restoreName, ios::binary);
+  if (!file)
+    return false;
+
+  // Pages of every record in order, registers and devices of the last one
+  SnapshotHeader header, last;
+  bool any = false;
+  while (file.read(reinterpret_cast<char *>(&header), sizeof(header)))
+  {
+    if (header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION)
+      return false;
+    for (uint32_t i = 0; i < header.pageCnt; i++)
+    {
+      uint32_t pageNum;
+      if (!file.read(reinterpret_cast<char *>(&pageNum), sizeof(pageNum)) ||
+          !file.read(reinterpret_cast<char *>(touchPage(pageNum << PAGE_BITS)->bytes), PAGE_SIZE))
+        return false;
+    }
+    last = header;
+    any = true;
+  }
+  if (!any)
+    return false;
+
+  retired = last.retired;
+  regs.assign(last.regs, last.regs + 16);
+  copy(last.csrRegs, last.csrRegs + 3, csrRegs.begin());
+  timerConfig = last.timerConfig & 0x7;
+  pendingInterrupts = last.pendingInterrupts;
+  timerDelay = last.timerDelay;
+  cout << "EMULATOR | Restored " << restoreName << " at " << retired << " instructions" << endl;
+  return true;
+}
+
+void Emulator::takeSnapshot()
+{
+  SnapshotHeader header;
+  header.retired = retired;
+  copy(regs.begin(), regs.end(), header.regs);
+  copy(csrRegs.begin(), csrRegs.begin() + 3, header.csrRegs);
+  header.timerConfig = timerConfig;
+  header.pendingInterrupts = pendingInterrupts;
+  header.timerDelay = eventDeadlines[EVENT_TIMER] - retired;
+
+  // Pages are copied here, only the file write runs in the background
+  vector<char> record(sizeof(header));
+  for (unsigned int t = 0; t < TABLE_SIZE; t++)
+  {
+    EmulatorPageTable *table = memory->tables[t].load();
+    if (!table)
+      continue;
+    for (unsigned int p = 0; p < TABLE_SIZE; p++)
+    {
+      EmulatorPage *page = table->pages[p].load();
+      if (!page || !(page->dirty || snapshotFull))
+        continue;
+      page->dirty = false;
+
+      uint32_t pageNum = (t << TABLE_BITS) | p;
+      const char *num = reinterpret_cast<const char *>(&pageNum);
+      record.insert(record.end(), num, num + sizeof(pageNum));
+      record.insert(record.end(), page->bytes, page->bytes + PAGE_SIZE);
+      header.pageCnt++;
+    }
+  }
+  memcpy(record.data(), &header, sizeof(header));
+  snapshotFull = false;
+
+  snapshots.write(record);
+}
+
+void Emulator::schedule(EmulatorEvent event, unsigned long long when)
+{
+  eventDeadlines[event] = when;
+  updateNextEvent();
+}
+
+void Emulator::updateNextEvent()
+{
+  unsigned long long next = NEVER;
+  for (const auto &deadline : eventDeadlines)
+    next = min(next, deadline);
+
+  // A running block must stop if the deadline moved in
+  if (next < nextEvent)
+    blockExit = true;
+  nextEvent = next;
+}
+
+void Emulator::serviceEvents()
+{
+  if (eventDeadlines[EVENT_LIMIT] <= retired)
+  {
+    if (retired >= maxInstructions)
+    {
+      stop(STOP_INSTRUCTION_LIMIT);
+      return;
+    }
+    if (timeoutMs && chrono::steady_clock::now() >= deadline)
+    {
+      stop(STOP_TIMEOUT);
+      return;
+    }
+    eventDeadlines[EVENT_LIMIT] = nextLimitCheck();
+  }
+
+  if (eventDeadlines[EVENT_TIMER] <= retired)
+  {
+    raiseInterrupt(TIMER_CAUSE);
+    eventDeadlines[EVENT_TIMER] = retired + TIMER_PERIODS_MS[timerConfig] * INSTRUCTIONS_PER_MS;
+  }
+
+  if (eventDeadlines[EVENT_TERMINAL] <= retired)
+  {
+    if (events.isReplaying())
+    {
+      if (replayType == LOGGED_TERMINAL)
+        deliverTerminal(replayValue);
+      replayNext();
+    }
+    else
+    {
+      // The next character is taken only once the previous one was delivered
+      char c;
+      if (!(pendingInterrupts & (1 << TERMINAL_CAUSE)) && terminal.read(c))
+      {
+        deliverTerminal(static_cast<unsigned char>(c));
+        if (events.isRecording())
+          events.record(retired, LOGGED_TERMINAL, static_cast<unsigned char>(c));
+      }
+      eventDeadlines[EVENT_TERMINAL] = retired + TERMINAL_POLL_INTERVAL;
+    }
+  }
+
+  if (eventDeadlines[EVENT_IPI] <= retired)
+  {
+    if (machine->machineStopped.load(memory_order_acquire))
+    {
+      stop(machine->machineStopReason);
+      return;
+    }
+    if (ipiPending.load(memory_order_relaxed) && ipiPending.exchange(false, memory_order_acquire))
+      raiseInterrupt(IPI_CAUSE);
+    eventDeadlines[EVENT_IPI] = retired + IPI_POLL_INTERVAL;
+  }
+
+  if (eventDeadlines[EVENT_SNAPSHOT] <= retired)
+  {
+    takeSnapshot();
+    eventDeadlines[EVENT_SNAPSHOT] = retired + snapshotPeriod;
+  }
+
+  if (eventDeadlines[EVENT_PROFILE] <= retired)
+  {
+    profiler.sample(regs[PC_REG]);
+    eventDeadlines[EVENT_PROFILE] = retired + profiler.getPeriod();
+  }
+
+  // Deliver at most one interrupt, timer first, then terminal, then other cpus
+  if (pendingInterrupts && !(csrRegs[STATUS_REG] & STATUS_INTERRUPT_MASK))
+  {
+    if ((pendingInterrupts & (1 << TIMER_CAUSE)) && !(csrRegs[STATUS_REG] & STATUS_TIMER_MASK))
+    {
+      pendingInterrupts &= ~(1 << TIMER_CAUSE);
+      enterInterrupt(TIMER_CAUSE);
+    }
+    else if ((pendingInterrupts & (1 << TERMINAL_CAUSE)) && !(csrRegs[STATUS_REG] & STATUS_TERMINAL_MASK))
+    {
+      pendingInterrupts &= ~(1 << TERMINAL_CAUSE);
+      enterInterrupt(TERMINAL_CAUSE);
+    }
+    else if (pendingInterrupts & (1 << IPI_CAUSE))
+    {
+      pendingInterrupts &= ~(1 << IPI_CAUSE);
+      enterInterrupt(IPI_CAUSE);
+    }
+  }
+
+  // Interrupts left pending are masked, they are retried on the next csr write
+  updateNextEvent();
+}
+
+unsigned long long Emulator::nextLimitCheck()
+{
+  return timeoutMs ? min(maxInstructions, retired + LIMIT_POLL_INTERVAL) : maxInstructions;
+}
+
+void Emulator::stop(EmulatorStop reason)
+{
+  // The loops check emulation right after servicing events and blocks exit early
+  if (emulation)
+    stopReason = reason;
+  emulation = false;
+  nextEvent = retired;
+  blockExit = true;
+
+  // Only halt is per cpu, the other cpus notice a machine stop when they poll
+  if (reason != STOP_HALT && cpuCnt > 1)
+    machine->stopMachine(reason, error);
+}
+
+void Emulator::stopMachine(EmulatorStop reason, const string &message)
+{
+  // The first cpu to stop the machine names the reason
+  lock_guard<mutex> lock(machineLock);
+  if (machineStopped.load(memory_order_relaxed))
+    return;
+  machineStopReason = reason;
+  machineError = message;
+  machineStopped.store(true, memory_order_release);
+}
+
+void Emulator::fault(const string &message)
+{
+  if (!headless)
+  {
+    cout << "ERROR | " << message << endl;
+    exit(-1);
+  }
+
+  if (error.empty())
+    error = message;
+  stop(STOP_FAULT);
+}
+
+void Emulator::deliverTerminal(unsigned char c)
+{
+  addToMemory(TERM_IN, c);
+  raiseInterrupt(TERMINAL_CAUSE);
+}
+
+void Emulator::replayNext()
+{
+  // The timer runs on retired instructions, so logged input is all a replay needs
+  eventDeadlines[EVENT_TERMINAL] = events.next(replayAt, replayType, replayValue) ? replayAt : NEVER;
+}
+
+void Emulator::retryInterrupts()
+{
+  // A csr write may have unmasked a pending interrupt, service it before the next instruction
+  if (pendingInterrupts)
+  {
+    nextEvent = retired;
+    blockExit = true;
+  }
+}
+
+void Emulator::raiseInterrupt(unsigned int cause)
+{
+  pendingInterrupts |= 1 << cause;
+}
+
+void Emulator::sendInterrupt(unsigned int target)
+{
+  // Release pairs with the target's acquire, so stores made before the send are visible to its handler
+  if (target == 0)
+    machine->ipiPending.store(true, memory_order_release);
+  else if (target < machine->cpuCnt)
+    machine->cpus[target - 1]->ipiPending.store(true, memory_order_release);
+}
+
+void Emulator::enterInterrupt(unsigned int cause)
+{
+  // push status; push pc; cause<=cause; status<=status&(~0x1); pc<=handle;
+  handleStore(PUSH_STATUS);
+  handleStore(PUSH_PC);
+  csrRegs[CAUSE_REG] = cause;
+  csrRegs[STATUS_REG] = csrRegs[STATUS_REG] & (~0x1);
+  if (profiling)
+    profiler.call(csrRegs[HANDLER_REG], regs[PC_REG]);
+  regs[PC_REG] = csrRegs[HANDLER_REG];
+}
+
+void Emulator::deviceWrite(unsigned int address, unsigned int value)
+{
+  switch (address)
+  {
+  case TERM_OUT:
+    machine->terminal.write(static_cast<char>(value & 0xFF));
+    break;
+  case TIM_CFG:
+    // A new period takes effect from now
+    timerConfig = value & 0x7;
+    schedule(EVENT_TIMER, retired + TIMER_PERIODS_MS[timerConfig] * INSTRUCTIONS_PER_MS);
+    break;
+  case IPI_SEND:
+    sendInterrupt(value);
+    break;
+  }
+}
+
+void Emulator::writeCsr(unsigned int index, unsigned int value)
+{
+  if (index != CPUID_REG)
+    csrRegs[index] = value;
+}
+
+void Emulator::printOutput()
+{
+  cout << "-----------------------------------------------------------------" << endl;
+  if (stopReason == STOP_HALT)
+    cout << "Emulated processor executed halt instruction" << endl;
+  else
+    cout << "Emulated processor stopped: " << STOP_NAMES[stopReason] << endl;
+
+  vector<Emulator *> all{this};
+  for (auto &cpu : cpus)
+    all.push_back(cpu.get());
+  for (Emulator *cpu : all)
+  {
+    if (cpus.empty())
+      cout << "Emulated processor state:" << endl;
+    else
+      cout << "Emulated processor " << dec << cpu->cpuId << " state:" << endl;
+
+    int i = 0;
+    for (const auto &reg : cpu->regs)
+    {
+      cout << (i < 10 ? " " : "") << "r" << dec << i << "=0x" << setw(8) << setfill('0') << hex << reg << " ";
+      if (++i % 4 == 0)
+        cout << endl;
+    }
+  }
+}
+
+static string jsonString(const string &text)
+{
+  string quoted = "\"";
+  for (unsigned char c : text)
+  {
+    if (c == '"' || c == '\\')
+      quoted += '\\';
+    if (c < 0x20)
+    {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    }
+    else
+      quoted += c;
+  }
+  return quoted + "\"";
+}
+
+string Emulator::getResult(const string &image)
+{
+  // The printOutput state as one JSON object
+  ostringstream result;
+  result << "{\"image\":" << jsonString(image)
+         << ",\"stop\":\"" << STOP_NAMES[stopReason] << "\"";
+  if (!error.empty())
+    result << ",\"error\":" << jsonString(error);
+  vector<Emulator *> all{this};
+  for (auto &cpu : cpus)
+    all.push_back(cpu.get());
+
+  // Summed over every cpu like the class counts
+  unsigned long long total = 0;
+  for (Emulator *cpu : all)
+    total += cpu->retired - cpu->startRetired;
+  result << ",\"retired\":" << total;
+  result << ",\"regs\":[";
+  for (size_t c = 0; c < all.size(); c++)
+  {
+    result << (c ? ",[" : "[");
+    for (size_t i = 0; i < all[c]->regs.size(); i++)
+      result << (i ? "," : "") << all[c]->regs[i];
+    result << "]";
+  }
+  result << "],\"hostMs\":" << fixed << setprecision(3) << hostSeconds * 1000;
+
+  const vector<unsigned long long> counts = sumClassCounts();
+  result << ",\"classes\":{";
+  for (int c = 0, n = 0; c <= INVALID_CLASS; c++)
+    if (counts[c] != 0)
+      result << (n++ ? "," : "") << "\"" << OPCODE_CLASS_NAMES[c] << "\":" << counts[c];
+  result << "},\"output\":" << jsonString(terminal.getCaptured()) << "}";
+  return result.str();
+}
+
+EmulatorPage *Emulator::findPage(unsigned int addr)
+{
+  EmulatorPageTable *table = memory->tables[addr >> (PAGE_BITS + TABLE_BITS)].load(memory_order_acquire);
+  if (!table)
+    return nullptr;
+
+  return table->pages[(addr >> PAGE_BITS) & (TABLE_SIZE - 1)].load(memory_order_acquire);
+}
+
+EmulatorPage *Emulator::touchPage(unsigned int addr)
+{
+  // Pages are allocated on first touch, untouched regions stay unallocated
+  EmulatorPage *page = findPage(addr);
+  return page ? page : mapPage(addr, nullptr);
+}
+
+EmulatorPage *Emulator::mapPage(unsigned int addr, unsigned char *bytes)
+{
+  // Backed by image bytes or by zeroed storage; of cpus racing on a first touch the first one wins
+  lock_guard<mutex> lock(memory->allocation);
+
+  atomic<EmulatorPageTable *> &tableSlot = memory->tables[addr >> (PAGE_BITS + TABLE_BITS)];
+  EmulatorPageTable *table = tableSlot.load(memory_order_relaxed);
+  if (!table)
+  {
+    table = new EmulatorPageTable();
+    tableSlot.store(table, memory_order_release);
+  }
+
+  atomic<EmulatorPage *> &pageSlot = table->pages[(addr >> PAGE_BITS) & (TABLE_SIZE - 1)];
+  EmulatorPage *page = pageSlot.load(memory_order_relaxed);
+  if (!page)
+  {
+    page = new EmulatorPage();
+    if (!bytes)
+    {
+      page->storage.reset(new unsigned char[PAGE_SIZE]());
+      bytes = page->storage.get();
+    }
+    page->bytes = bytes;
+    pageSlot.store(page, memory_order_release);
+  }
+
+  return page;
+}
+
+vector<unsigned long long> Emulator::sumClassCounts()
+{
+  // Summed over every cpu, the unused opcode classes land in the first invalid one
+  vector<unsigned long long> counts(OPCODE_CLASSES);
+  for (int c = 0; c < OPCODE_CLASSES; c++)
+  {
+    counts[min(c, INVALID_CLASS)] += classCounts[c];
+    for (auto &cpu : cpus)
+      counts[min(c, INVALID_CLASS)] += cpu->classCounts[c];
+  }
+  return counts;
+}
+
+void Emulator::printStats()
+{
+  // Only what this run executed
+  unsigned long long total = retired - startRetired;
+  for (auto &cpu : cpus)
+    total += cpu->retired - cpu->startRetired;
+
+  cout << "EMULATOR | Retired " << dec << total << " instructions in " << fixed << setprecision(3) << hostSeconds << " s";
+  if (hostSeconds > 0)
+    cout << " (" << setprecision(2) << total / hostSeconds / 1e6 << " MIPS)";
+  cout << endl;
+
+  const vector<unsigned long long> counts = sumClassCounts();
+  cout << "EMULATOR | Classes:";
+  for (int c = 0; c <= INVALID_CLASS; c++)
+    if (counts[c] != 0)
+      cout << " " << OPCODE_CLASS_NAMES[c] << " " << counts[c];
+  cout << endl;
+}
+
+void Emulator::printCacheStats()
+{
+  // Summed over every cpu
+  unsigned long long hits = cacheHits, misses = cacheMisses;
+  unsigned long long translated = blocksTranslated, executed = blocksExecuted;
+  for (auto &cpu : cpus)
+  {
+    hits += cpu->cacheHits;
+    misses += cpu->cacheMisses;
+    translated += cpu->blocksTranslated;
+    executed += cpu->blocksExecuted;
+  }
+
+  if (core == CORE_BLOCK)
+  {
+    cout << "EMULATOR | Blocks: " << dec << translated << " translated, " << executed << " executed" << endl;
+    return;
+  }
+
+  const unsigned long long total = hits + misses;
+  cout << "EMULATOR | Decode cache: " << dec << hits << " hits, " << misses << " misses";
+  if (total != 0)
+    cout << " (" << fixed << setprecision(2) << 100.0 * hits / total << "% hit ratio)";
+  cout << endl;
+}
+
+unsigned char Emulator::findByte(unsigned int addr)
+{
+  EmulatorPage *page = findPage(addr);
+  if (!page)
+  {
+    fault("Empty memory @ " + to_string(addr));
+    return 0;
+  }
+
+  return page->bytes[addr & PAGE_MASK];
+}
+
+void Emulator::addByte(unsigned int addr, unsigned char value)
+{
+  EmulatorPage *page = touchPage(addr);
+  page->bytes[addr & PAGE_MASK] = value;
+  page->dirty.store(true, memory_order_relaxed);
+  if (page->decoded[cpuId])
+    invalidateDecoded(page, addr & PAGE_MASK);
+  if (page->translated[cpuId])
+    invalidateBlocks(addr, 1);
+  publishStore(page);
+}
+
+void Emulator::markCode(EmulatorPage *page)
+{
+  // Ordered against the stores of other cpus by the fence in publishStore
+  if (!page->hasCode.load(memory_order_relaxed))
+    page->hasCode.store(true, memory_order_seq_cst);
+}
+
+void Emulator::publishStore(EmulatorPage *page)
+{
+  // The other cpus only learn of stores into code through the page generation
+  if (cpuCnt == 1)
+    return;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (!page->hasCode.load(memory_order_relaxed))
+    return;
+
+  // Our own caches are already exact, unless another cpu bumped the page meanwhile
+  const unsigned int old = page->generation.fetch_add(1, memory_order_acq_rel);
+  if (page->seen[cpuId] == old)
+    page->seen[cpuId] = old + 1;
+}
+
+void Emulator::syncCode(EmulatorPage *page, unsigned int addr)
+{
+  // Another cpu stored into the page, nothing cached from it can be trusted
+  page->seen[cpuId] = page->generation.load(memory_order_acquire);
+  if (page->decoded[cpuId])
+    for (auto &entry : page->decoded[cpuId]->entries)
+      entry.valid = false;
+  if (page->translated[cpuId])
+    invalidateBlocks(addr & ~PAGE_MASK, PAGE_SIZE);
+}
+
+void Emulator::invalidateDecoded(EmulatorPage *page, unsigned int offset)
+{
+  // Entry memory is never freed here, a handler may be running from it
+  page->decoded[cpuId]->entries[offset >> 2].valid = false;
+}
+
+Instruction Emulator::decodeInstruction(unsigned int pc)
+{
+  unsigned char bytes[4];
+
+  EmulatorPage *page = findPage(pc);
+  if (page && (pc & PAGE_MASK) <= PAGE_SIZE - 4)
+  {
+    const unsigned char *src = page->bytes + (pc & PAGE_MASK);
+    bytes[0] = src[0];
+    bytes[1] = src[1];
+    bytes[2] = src[2];
+    bytes[3] = src[3];
+  }
+  else
+  {
+    // Instruction crosses a page boundary
+    for (int i = 0; i < 4; i++)
+      bytes[i] = findByte(pc + i);
+  }
+
+  Instruction ins;
+  ins.op = bytes[0];
+  ins.A = (bytes[1] & 0xF0) >> 4;
+  ins.B = bytes[1] & 0x0F;
+  ins.C = (bytes[2] & 0xF0) >> 4;
+  ins.D = ((bytes[2] & 0x0F) << 8) | bytes[3];
+
+  return ins;
+}
+
+Instruction Emulator::getInstruction()
+{
+  Instruction ins = decodeInstruction(regs[PC_REG]);
+  regs[PC_REG] += 4;
+
+  return ins;
+}
+
+InstructionHandler Emulator::getHandler(unsigned char op)
+{
+  switch (op & 0xF0)
+  {
+  case HALT_OC:
+    return &Emulator::handleHalt;
+  case INT_OC:
+    return &Emulator::handleInt;
+  case CALL_OC:
+    return &Emulator::handleCall;
+  case JUMP_OC:
+    return &Emulator::handleJump;
+  case XCHG_OC:
+    return &Emulator::handleXchg;
+  case ARIT_OC:
+    return &Emulator::handleArit;
+  case LOGIC_OC:
+    return &Emulator::handleLogic;
+  case SHIFT_OC:
+    return &Emulator::handleShift;
+  case STORE_OC:
+    return &Emulator::handleStore;
+  case LOAD_OC:
+    return &Emulator::handleLoad;
+  }
+  return &Emulator::handleInvalid;
+}
+
+InstructionHandler Emulator::getOpcodeHandler(unsigned char op)
+{
+  switch (op & 0xF0)
+  {
+  case HALT_OC:
+    return &Emulator::handleHalt;
+  case INT_OC:
+    return &Emulator::handleInt;
+  case XCHG_OC:
+    return &Emulator::handleXchg;
+  }
+
+  switch (op)
+  {
+  case CALL_OC | CALL_MOD0:
+    return &Emulator::opCallMod0;
+  case CALL_OC | CALL_MOD1:
+    return &Emulator::opCallMod1;
+  case JUMP_OC | JMP_MOD0:
+    return &Emulator::opJmpMod0;
+  case JUMP_OC | JMP_MOD1:
+    return &Emulator::opJmpMod1;
+  case JUMP_OC | JMP_MOD2:
+    return &Emulator::opJmpMod2;
+  case JUMP_OC | JMP_MOD3:
+    return &Emulator::opJmpMod3;
+  case JUMP_OC | JMP_MOD4:
+    return &Emulator::opJmpMod4;
+  case JUMP_OC | JMP_MOD5:
+    return &Emulator::opJmpMod5;
+  case JUMP_OC | JMP_MOD6:
+    return &Emulator::opJmpMod6;
+  case JUMP_OC | JMP_MOD7:
+    return &Emulator::opJmpMod7;
+  case ARIT_OC | ADD_MOD:
+    return &Emulator::opAdd;
+  case ARIT_OC | SUB_MOD:
+    return &Emulator::opSub;
+  case ARIT_OC | MUL_MOD:
+    return &Emulator::opMul;
+  case ARIT_OC | DIV_MOD:
+    return &Emulator::opDiv;
+  case LOGIC_OC | NOT_MOD:
+    return &Emulator::opNot;
+  case LOGIC_OC | AND_MOD:
+    return &Emulator::opAnd;
+  case LOGIC_OC | OR_MOD:
+    return &Emulator::opOr;
+  case LOGIC_OC | XOR_MOD:
+    return &Emulator::opXor;
+  case SHIFT_OC | SHL_MOD:
+    return &Emulator::opShl;
+  case SHIFT_OC | SHR_MOD:
+    return &Emulator::opShr;
+  case STORE_OC | STORE_MOD0:
+    return &Emulator::opStoreMod0;
+  case STORE_OC | STORE_MOD1:
+    return &Emulator::opStoreMod1;
+  case STORE_OC | STORE_MOD2:
+    return &Emulator::opStoreMod2;
+  case LOAD_OC | LOAD_MOD0:
+    return &Emulator::opLoadMod0;
+  case LOAD_OC | LOAD_MOD1:
+    return &Emulator::opLoadMod1;
+  case LOAD_OC | LOAD_MOD2:
+    return &Emulator::opLoadMod2;
+  case LOAD_OC | LOAD_MOD3:
+    return &Emulator::opLoadMod3;
+  case LOAD_OC | LOAD_MOD4:
+    return &Emulator::opLoadMod4;
+  case LOAD_OC | LOAD_MOD5:
+    return &Emulator::opLoadMod5;
+  case LOAD_OC | LOAD_MOD6:
+    return &Emulator::opLoadMod6;
+  case LOAD_OC | LOAD_MOD7:
+    return &Emulator::opLoadMod7;
+  }
+  return &Emulator::handleInvalid;
+}
+
+DecodedInstruction &Emulator::fetchInstruction()
+{
+  const unsigned int pc = regs[PC_REG];
+
+  // Only word-aligned instructions are cached, one entry per word of the page
+  EmulatorPage *page = findPage(pc);
+  if (page && (pc & 0x3) == 0)
+  {
+    unique_ptr<EmulatorDecodedPage> &decoded = page->decoded[cpuId];
+    if (!decoded)
+    {
+      decoded.reset(new EmulatorDecodedPage());
+      markCode(page);
+    }
+    if (page->seen[cpuId] != page->generation.load(memory_order_acquire))
+      syncCode(page, pc);
+
+    DecodedInstruction &entry = decoded->entries[(pc & PAGE_MASK) >> 2];
+    if (entry.valid)
+    {
+      cacheHits++;
+      entry.count++;
+      regs[PC_REG] += 4;
+      return entry;
+    }
+
+    // The stale instruction's executions are folded in before it is replaced
+    cacheMisses++;
+    classCounts[entry.ins.op >> 4] += entry.count;
+    entry.ins = getInstruction();
+    entry.handler = getHandler(entry.ins.op);
+    entry.valid = true;
+    entry.count = 1;
+    return entry;
+  }
+
+  cacheMisses++;
+  uncached.ins = getInstruction();
+  classCounts[uncached.ins.op >> 4]++;
+  uncached.handler = getHandler(uncached.ins.op);
+  return uncached;
+}
+
+unsigned int Emulator::getFromMemory(unsigned int addr)
+{
+  EmulatorPage *page = findPage(addr);
+  if (page && (addr & 0x3) == 0)
+    return loadWord(page->bytes + (addr & PAGE_MASK));
+  if (page && (addr & PAGE_MASK) <= PAGE_SIZE - 4)
+  {
+    const unsigned char *src = page->bytes + (addr & PAGE_MASK);
+    return src[0] | (src[1] << 8) | (src[2] << 16) | (static_cast<unsigned int>(src[3]) << 24);
+  }
+
+  // Word crosses a page boundary
+  unsigned int val = 0;
+  for (int i = 0; i < 4; ++i)
+  {
+    val |= static_cast<unsigned int>(findByte(addr + i)) << (8 * i);
+  }
+  return val;
+}
+
+void Emulator::addToMemory(unsigned int address, unsigned int value)
+{
+  if ((address & PAGE_MASK) <= PAGE_SIZE - 4)
+  {
+    EmulatorPage *page = touchPage(address);
+    page->dirty.store(true, memory_order_relaxed);
+    unsigned char *dst = page->bytes + (address & PAGE_MASK);
+    if ((address & 0x3) == 0)
+      storeWord(dst, value);
+    else
+      for (int j = 0; j < 4; j++)
+      {
+        dst[j] = getByte(value, j);
+      }
+
+    // Self-modifying code: drop the (at most two) decoded words this store overlaps
+    if (page->decoded[cpuId])
+    {
+      invalidateDecoded(page, address & PAGE_MASK);
+      invalidateDecoded(page, (address & PAGE_MASK) + 3);
+    }
+    if (page->translated[cpuId])
+      invalidateBlocks(address, 4);
+    publishStore(page);
+    if (address >= MMIO_START)
+      deviceWrite(address, value);
+    return;
+  }
+
+  // Word crosses a page boundary
+  for (int j = 0; j < 4; j++)
+  {
+    addByte(address + j, getByte(value, j));
+  }
+  if (address >= MMIO_START)
+    deviceWrite(address, value);
+}
+
+void Emulator::emulate()
+{
+  const auto started = chrono::steady_clock::now();
+  startRetired = retired;
+
+  // The other cpus run on their own host threads until each executes halt, or a fault
+  // or limit on any cpu stops them all
+  vector<thread> workers;
+  for (auto &cpu : cpus)
+    workers.emplace_back(&Emulator::emulate, cpu.get());
+
+  // The loop is instantiated per trace level so the untraced one carries no logging
+  switch (traceLevel)
+  {
+  case TRACE_NONE:
+    core == CORE_BLOCK ? runBlocks<TRACE_NONE>() : core == CORE_THREADED ? runThreaded<TRACE_NONE>() : run<TRACE_NONE>();
+    break;
+  case TRACE_BRANCHES:
+    core == CORE_BLOCK ? runBlocks<TRACE_BRANCHES>() : core == CORE_THREADED ? runThreaded<TRACE_BRANCHES>() : run<TRACE_BRANCHES>();
+    break;
+  case TRACE_ALL:
+    core == CORE_BLOCK ? runBlocks<TRACE_ALL>() : core == CORE_THREADED ? runThreaded<TRACE_ALL>() : run<TRACE_ALL>();
+    break;
+  }
+  for (auto &worker : workers)
+    worker.join();
+  if (machineStopped.load(memory_order_acquire))
+  {
+    stopReason = machineStopReason;
+    error = machineError;
+  }
+  collectClassCounts();
+  hostSeconds = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+  trace.flush();
+  terminal.stop();
+  snapshots.wait();
+  events.flush();
+
+  if (profiling && !profiler.write())
+    cout << "ERROR | Cannot write the profile!" << endl;
+}
+
+template <TraceLevel level>
+void Emulator::run()
+{
+  while (emulation)
+  {
+    if (retired >= nextEvent)
+    {
+      serviceEvents();
+      if (!emulation)
+        break;
+    }
+
+    const unsigned int pc = regs[PC_REG];
+    DecodedInstruction &decoded = fetchInstruction();
+    retired++;
+
+    if (level == TRACE_ALL || (level == TRACE_BRANCHES && isBranch(decoded.ins)))
+      trace.write(regs[SP_REG], pc, mnemonic(decoded.ins.op));
+
+    (this->*decoded.handler)(decoded.ins);
+  }
+}
+
+template <TraceLevel level>
+void Emulator::runThreaded()
+{
+#if defined(__GNUC__) && !defined(EMULATOR_NO_COMPUTED_GOTO)
+  // Direct threading: every handler ends with its own fetch and indirect jump
+  void *labels[256];
+  for (int op = 0; op < 256; op++)
+  {
+    switch (op & 0xF0)
+    {
+    case HALT_OC:
+      labels[op] = &&halt;
+      break;
+    case INT_OC:
+      labels[op] = &&int_;
+      break;
+    case XCHG_OC:
+      labels[op] = &&xchg;
+      break;
+    default:
+      labels[op] = &&invalid;
+      break;
+    }
+  }
+  labels[CALL_OC | CALL_MOD0] = &&callMod0;
+  labels[CALL_OC | CALL_MOD1] = &&callMod1;
+  labels[JUMP_OC | JMP_MOD0] = &&jmpMod0;
+  labels[JUMP_OC | JMP_MOD1] = &&jmpMod1;
+  labels[JUMP_OC | JMP_MOD2] = &&jmpMod2;
+  labels[JUMP_OC | JMP_MOD3] = &&jmpMod3;
+  labels[JUMP_OC | JMP_MOD4] = &&jmpMod4;
+  labels[JUMP_OC | JMP_MOD5] = &&jmpMod5;
+  labels[JUMP_OC | JMP_MOD6] = &&jmpMod6;
+  labels[JUMP_OC | JMP_MOD7] = &&jmpMod7;
+  labels[ARIT_OC | ADD_MOD] = &&add;
+  labels[ARIT_OC | SUB_MOD] = &&sub;
+  labels[ARIT_OC | MUL_MOD] = &&mul;
+  labels[ARIT_OC | DIV_MOD] = &&div;
+  labels[LOGIC_OC | NOT_MOD] = &&not_;
+  labels[LOGIC_OC | AND_MOD] = &&and_;
+  labels[LOGIC_OC | OR_MOD] = &&or_;
+  labels[LOGIC_OC | XOR_MOD] = &&xor_;
+  labels[SHIFT_OC | SHL_MOD] = &&shl;
+  labels[SHIFT_OC | SHR_MOD] = &&shr;
+  labels[STORE_OC | STORE_MOD0] = &&storeMod0;
+  labels[STORE_OC | STORE_MOD1] = &&storeMod1;
+  labels[STORE_OC | STORE_MOD2] = &&storeMod2;
+  labels[LOAD_OC | LOAD_MOD0] = &&loadMod0;
+  labels[LOAD_OC | LOAD_MOD1] = &&loadMod1;
+  labels[LOAD_OC | LOAD_MOD2] = &&loadMod2;
+  labels[LOAD_OC | LOAD_MOD3] = &&loadMod3;
+  labels[LOAD_OC | LOAD_MOD4] = &&loadMod4;
+  labels[LOAD_OC | LOAD_MOD5] = &&loadMod5;
+  labels[LOAD_OC | LOAD_MOD6] = &&loadMod6;
+  labels[LOAD_OC | LOAD_MOD7] = &&loadMod7;
+
+  DecodedInstruction *decoded;
+  unsigned int pc;
 
-  Emulator emulator;
-  emulator.loadMemory(inputFile);
-  emulator.initRegisters();
-  emulator.emulate();
+#define DISPATCH()                                                                 \
+  if (retired >= nextEvent)                                                        \
+  {                                                                                \
+    serviceEvents();                                                               \
+    if (!emulation)                                                                \
+      return;                                                                      \
+  }                                                                                \
+  pc = regs[PC_REG];                                                               \
+  decoded = &fetchInstruction();                                                   \
+  retired++;                                                                       \
+  if (level == TRACE_ALL || (level == TRACE_BRANCHES && isBranch(decoded->ins))) \
+    trace.write(regs[SP_REG], pc, mnemonic(decoded->ins.op));                      \
+  goto *labels[decoded->ins.op]
 
-  cout << "EMULATOR | End" << endl;
+  DISPATCH();
 
-  emulator.printOutput();
+halt:
+  handleHalt(decoded->ins);
+  return;
+int_:
+  handleInt(decoded->ins);
+  DISPATCH();
+xchg:
+  handleXchg(decoded->ins);
+  DISPATCH();
+callMod0:
+  opCallMod0(decoded->ins);
+  DISPATCH();
+callMod1:
+  opCallMod1(decoded->ins);
+  DISPATCH();
+jmpMod0:
+  opJmpMod0(decoded->ins);
+  DISPATCH();
+jmpMod1:
+  opJmpMod1(decoded->ins);
+  DISPATCH();
+jmpMod2:
+  opJmpMod2(decoded->ins);
+  DISPATCH();
+jmpMod3:
+  opJmpMod3(decoded->ins);
+  DISPATCH();
+jmpMod4:
+  opJmpMod4(decoded->ins);
+  DISPATCH();
+jmpMod5:
+  opJmpMod5(decoded->ins);
+  DISPATCH();
+jmpMod6:
+  opJmpMod6(decoded->ins);
+  DISPATCH();
+jmpMod7:
+  opJmpMod7(decoded->ins);
+  DISPATCH();
+add:
+  opAdd(decoded->ins);
+  DISPATCH();
+sub:
+  opSub(decoded->ins);
+  DISPATCH();
+mul:
+  opMul(decoded->ins);
+  DISPATCH();
+div:
+  opDiv(decoded->ins);
+  DISPATCH();
+not_:
+  opNot(decoded->ins);
+  DISPATCH();
+and_:
+  opAnd(decoded->ins);
+  DISPATCH();
+or_:
+  opOr(decoded->ins);
+  DISPATCH();
+xor_:
+  opXor(decoded->ins);
+  DISPATCH();
+shl:
+  opShl(decoded->ins);
+  DISPATCH();
+shr:
+  opShr(decoded->ins);
+  DISPATCH();
+storeMod0:
+  opStoreMod0(decoded->ins);
+  DISPATCH();
+storeMod1:
+  opStoreMod1(decoded->ins);
+  DISPATCH();
+storeMod2:
+  opStoreMod2(decoded->ins);
+  DISPATCH();
+loadMod0:
+  opLoadMod0(decoded->ins);
+  DISPATCH();
+loadMod1:
+  opLoadMod1(decoded->ins);
+  DISPATCH();
+loadMod2:
+  opLoadMod2(decoded->ins);
+  DISPATCH();
+loadMod3:
+  opLoadMod3(decoded->ins);
+  DISPATCH();
+loadMod4:
+  opLoadMod4(decoded->ins);
+  DISPATCH();
+loadMod5:
+  opLoadMod5(decoded->ins);
+  DISPATCH();
+loadMod6:
+  opLoadMod6(decoded->ins);
+  DISPATCH();
+loadMod7:
+  opLoadMod7(decoded->ins);
+  DISPATCH();
+invalid:
+  handleInvalid(decoded->ins);
+  DISPATCH();
 
-  return 0;
+#undef DISPATCH
+#else
+  // Portable fallback: one indirect call through the full-opcode table
+  InstructionHandler opcodeTable[256];
+  for (int op = 0; op < 256; op++)
+    opcodeTable[op] = getOpcodeHandler(op);
+
+  while (emulation)
+  {
+    if (retired >= nextEvent)
+    {
+      serviceEvents();
+      if (!emulation)
+        break;
+    }
+
+    const unsigned int pc = regs[PC_REG];
+    DecodedInstruction &decoded = fetchInstruction();
+    retired++;
+
+    if (level == TRACE_ALL || (level == TRACE_BRANCHES && isBranch(decoded.ins)))
+      trace.write(regs[SP_REG], pc, mnemonic(decoded.ins.op));
+
+    (this->*opcodeTable[decoded.ins.op])(decoded.ins);
+  }
+#endif
 }
 
-void Emulator::loadMemory(ifstream &inputFile)
+template <TraceLevel level>
+void Emulator::runBlocks()
 {
-  string line;
-  while (getline(inputFile, line))
+  while (emulation)
   {
-    const unsigned int address = stoul(line.substr(0, 8), nullptr, 16);
-    unsigned int cursor = 10;
+    if (retired >= nextEvent)
+    {
+      serviceEvents();
+      if (!emulation)
+        break;
+    }
 
-    for (int i = 0; i < 8; i++)
+    TranslatedBlock *block = findBlock(regs[PC_REG]);
+    if (!block)
     {
-      const char value = static_cast<char>(stoul(line.substr(cursor, 2), nullptr, 16));
+      // Unaligned pc, interpret a single instruction
+      const unsigned int pc = regs[PC_REG];
+      DecodedInstruction &decoded = fetchInstruction();
+      retired++;
 
-      memory.emplace_back(EmulatorMemoryEntry{address + i, value});
-      cursor += 3;
+      if (level == TRACE_ALL || (level == TRACE_BRANCHES && isBranch(decoded.ins)))
+        trace.write(regs[SP_REG], pc, mnemonic(decoded.ins.op));
+      if (profileBlocks)
+        profiler.sample(pc);
+
+      (this->*decoded.handler)(decoded.ins);
+      continue;
+    }
+
+    // Stop early if an event falls due inside the block, so interrupts land exactly
+    size_t count = block->ops.size();
+    if (nextEvent - retired < count)
+      count = nextEvent - retired;
+
+    // Calls and returns end blocks, so the whole block runs in the node it starts in
+    const int node = profileBlocks ? profiler.currentNode() : 0;
+
+    blocksExecuted++;
+    currentBlock = block;
+    blockExit = false;
+    size_t i = 0;
+    while (i < count)
+    {
+      if (level == TRACE_ALL || (level == TRACE_BRANCHES && isBranch(block->code[i])))
+        trace.write(regs[SP_REG], block->start + 4 * i, mnemonic(block->code[i].op));
+
+      block->ops[i++]();
+      if (blockExit)
+        break;
+    }
+    retired += i;
+    currentBlock = nullptr;
+
+    // Complete runs are counted per block, the rare early exit per instruction
+    if (i == block->ops.size())
+      block->executions++;
+    else
+      for (size_t j = 0; j < i; j++)
+      {
+        classCounts[block->code[j].op >> 4]++;
+        if (profileBlocks)
+          profiler.count(block->start + 4 * j, 1);
+      }
+    if (profileBlocks)
+      profiler.countNode(node, i);
+
+    if (!retiredBlocks.empty())
+    {
+      for (auto &retiredBlock : retiredBlocks)
+        flushBlockCounts(*retiredBlock);
+      retiredBlocks.clear();
     }
   }
-  inputFile.close();
 }
 
-void Emulator::initRegisters()
+void Emulator::flushBlockCounts(TranslatedBlock &block)
 {
-  // Initialize 15 regs with 0
-  regs.resize(15, 0);
+  if (block.executions == 0)
+    return;
 
-  // Initialize the program counter register with PC_START
-  regs.push_back(PC_START);
-
-  // Initialize 3 CSR regs with 0
-  csrRegs.resize(3, 0);
+  for (size_t i = 0; i < block.code.size(); i++)
+  {
+    classCounts[block.code[i].op >> 4] += block.executions;
+    if (profileBlocks)
+      profiler.count(block.start + 4 * i, block.executions);
+  }
+  block.executions = 0;
 }
 
-void Emulator::printOutput()
+void Emulator::collectClassCounts()
 {
-  cout << "-----------------------------------------------------------------" << endl;
-  cout << "Emulated processor executed halt instruction" << endl;
-  cout << "Emulated processor state:" << endl;
+  // Fold in what the decoded entries and blocks still hold
+  for (auto &block : blocks)
+    flushBlockCounts(*block.second);
+  for (auto &block : retiredBlocks)
+    flushBlockCounts(*block);
 
-  int i = 0;
-  for (const auto &reg : regs)
+  for (auto &table : memory->tables)
   {
-    cout << (i < 10 ? " " : "") << "r" << dec << i << "=0x" << setw(8) << setfill('0') << hex << reg << " ";
-    if (++i % 4 == 0)
-      cout << endl;
+    EmulatorPageTable *pageTable = table.load(memory_order_acquire);
+    if (!pageTable)
+      continue;
+    for (auto &slot : pageTable->pages)
+    {
+      EmulatorPage *page = slot.load(memory_order_acquire);
+      if (!page || !page->decoded[cpuId])
+        continue;
+      for (auto &entry : page->decoded[cpuId]->entries)
+      {
+        classCounts[entry.ins.op >> 4] += entry.count;
+        entry.count = 0;
+      }
+    }
   }
 }
 
-unsigned char Emulator::findByte(unsigned int addr)
+// Instructions after which a block must end: anything that writes pc,
+// halts, raises an interrupt or writes a csr
+static bool endsBlock(const Instruction &ins)
 {
-  for (const auto &entry : memory)
+  switch (ins.op & 0xF0)
   {
-    if (entry.address == addr)
-      return entry.value;
+  case HALT_OC:
+  case INT_OC:
+  case CALL_OC:
+  case JUMP_OC:
+    return true;
+  case XCHG_OC:
+    return ins.B == PC_REG || ins.C == PC_REG;
+  case ARIT_OC:
+  case LOGIC_OC:
+  case SHIFT_OC:
+    return ins.A == PC_REG;
+  case STORE_OC:
+    return ins.op == (STORE_OC | STORE_MOD2) && ins.A == PC_REG;
+  case LOAD_OC:
+    switch (ins.op)
+    {
+    case LOAD_OC | LOAD_MOD0:
+    case LOAD_OC | LOAD_MOD1:
+    case LOAD_OC | LOAD_MOD2:
+      return ins.A == PC_REG;
+    case LOAD_OC | LOAD_MOD3:
+      return ins.A == PC_REG || ins.B == PC_REG;
+    case LOAD_OC | LOAD_MOD4:
+    case LOAD_OC | LOAD_MOD5:
+    case LOAD_OC | LOAD_MOD6:
+    case LOAD_OC | LOAD_MOD7:
+      return true;
+    }
   }
-
-  cout << "ERROR | Empty memory @ " << addr << endl;
-  exit(-1);
+  return false;
 }
 
-Instruction Emulator::getInstruction()
+TranslatedBlock *Emulator::findBlock(unsigned int pc)
 {
-  Instruction ins;
-  unsigned char byte = findByte(regs[PC_REG]);
-  ins.op = byte;
-  regs[PC_REG]++;
+  if (pc & 0x3)
+    return nullptr;
 
-  byte = findByte(regs[PC_REG]);
-  ins.A = (byte & 0xF0) >> 4;
-  ins.B = byte & 0x0F;
-  regs[PC_REG]++;
+  auto it = blocks.find(pc);
+  if (it != blocks.end())
+  {
+    TranslatedBlock *block = it->second.get();
+    if (block->page->seen[cpuId] == block->page->generation.load(memory_order_acquire))
+      return block;
+    syncCode(block->page, pc); // retires the block, it is translated again below
+  }
 
-  byte = findByte(regs[PC_REG]);
-  ins.C = (byte & 0xF0) >> 4;
-  ins.D = (byte & 0x0F) << 8;
-  regs[PC_REG]++;
+  // Translate up to the first block-ending instruction, never past the page
+  EmulatorPage *page = findPage(pc);
+  if (!page)
+    return nullptr; // let the interpreter report the empty memory
+  markCode(page);
+  if (page->seen[cpuId] != page->generation.load(memory_order_acquire))
+    syncCode(page, pc);
 
-  byte = findByte(regs[PC_REG]);
-  ins.D |= byte;
-  regs[PC_REG]++;
+  unique_ptr<TranslatedBlock> block(new TranslatedBlock());
+  block->start = pc;
+  block->page = page;
+  unsigned int addr = pc;
+  do
+  {
+    Instruction ins = decodeInstruction(addr);
+    addr += 4;
+    block->code.push_back(ins);
+    block->ops.push_back(translate(ins, addr));
+    if (endsBlock(ins))
+      break;
+  } while ((addr & PAGE_MASK) != 0 && block->ops.size() < MAX_BLOCK_LENGTH);
+  block->end = addr;
 
-  return ins;
-}
+  page->translated[cpuId] = true;
+  pageBlocks[pc >> PAGE_BITS].push_back(pc);
+  blocksTranslated++;
 
-unsigned int Emulator::getFromMemory(unsigned int addr)
-{
-  unsigned int val = 0;
-  for (int i = 0; i < 4; ++i)
-  {
-    val |= static_cast<unsigned char>(findByte(addr + i)) << (8 * i);
-  }
-  return val;
+  TranslatedBlock *result = block.get();
+  blocks[pc] = move(block);
+  return result;
 }
 
-void Emulator::addToMemory(unsigned int address, unsigned int value)
+void Emulator::invalidateBlocks(unsigned int addr, unsigned int size)
 {
-  int i = 0;
-  for (; i < memory.size(); i++)
-  {
-    if (memory[i].address == address)
-      break;
-  }
+  // Blocks never cross pages, so only the pages of the first and last byte matter
+  const unsigned int firstPage = addr >> PAGE_BITS;
+  const unsigned int lastPage = (addr + size - 1) >> PAGE_BITS;
 
-  if (i == memory.size())
-  {
-    for (int j = 0; j < 4; j++)
-    {
-      EmulatorMemoryEntry entry;
-      entry.address = address + j;
-      entry.value = getByte(value, j);
-      memory.push_back(entry);
-    }
-  }
-  else
+  for (unsigned int pageNum = firstPage;; pageNum++)
   {
-    for (int j = 0; j < 4; j++)
+    auto listIt = pageBlocks.find(pageNum);
+    if (listIt != pageBlocks.end())
     {
-      memory[i + j].value = getByte(value, j);
+      vector<unsigned int> &starts = listIt->second;
+      for (size_t i = 0; i < starts.size();)
+      {
+        auto blockIt = blocks.find(starts[i]);
+        TranslatedBlock *block = blockIt->second.get();
+        if (block->start < addr + size && addr < block->end)
+        {
+          // A running block is only retired, it is freed once it stops executing
+          if (block == currentBlock)
+            blockExit = true;
+          retiredBlocks.push_back(move(blockIt->second));
+          blocks.erase(blockIt);
+          starts[i] = starts.back();
+          starts.pop_back();
+        }
+        else
+        {
+          i++;
+        }
+      }
     }
+
+    if (pageNum == lastPage)
+      break;
   }
 }
 
-void Emulator::emulate()
+function<void()> Emulator::translate(Instruction ins, unsigned int next)
 {
-  while (emulation)
+  // Each closure sets pc past its instruction first, exactly as the fetch does
+  const unsigned int a = ins.A;
+  const unsigned int b = ins.B;
+  const unsigned int c = ins.C;
+  const unsigned int d = complement2(ins.D);
+
+  // Profiled returns have to go through the load handlers
+  if (profiling && a == PC_REG)
+    return [this, handler = getOpcodeHandler(ins.op), ins, next]() mutable
+    { regs[PC_REG] = next; (this->*handler)(ins); };
+
+  switch (ins.op)
   {
-    cout << "EMULATOR | " << hex << "SP=" << regs[SP_REG] << ", PC=" << regs[PC_REG] << endl;
-    Instruction ins = getInstruction();
-    switch (ins.op & 0xF0)
-    {
-    case HALT_OC:
-      // Zaustavlja procesor kao i dalje izvršavanje narednih instrukcija.
-      cout << "halt" << endl;
-      emulation = false;
-      break;
-    case INT_OC:
-      // push status; push pc; cause<=4; status<=status&(~0x1); pc<=handle;
-      cout << "int" << endl;
-      handleStore(PUSH_STATUS);
-      handleStore(PUSH_PC);
-      csrRegs[CAUSE_REG] = 4;
-      csrRegs[STATUS_REG] = csrRegs[STATUS_REG] & (~0x1);
-      regs[PC_REG] = csrRegs[HANDLER_REG];
-      break;
-    case CALL_OC:
-      handleCall(ins);
-      break;
-    case JUMP_OC:
-      handleJump(ins);
-      break;
-    case XCHG_OC:
-      // temp<=gpr[B]; gpr[B]<=gpr[C]; gpr[C]<=temp;
-      cout << "xchg" << endl;
-      swap(regs[ins.B], regs[ins.C]);
-      break;
-    case ARIT_OC:
-      handleArit(ins);
-      break;
-    case LOGIC_OC:
-      handleLogic(ins);
-      break;
-    case SHIFT_OC:
-      handleShift(ins);
-      break;
-    case STORE_OC:
-      handleStore(ins);
-      break;
-    case LOAD_OC:
-      handleLoad(ins);
-      break;
-    }
+  case ARIT_OC | ADD_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] + regs[c]; };
+  case ARIT_OC | SUB_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] - regs[c]; };
+  case ARIT_OC | MUL_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] * regs[c]; };
+  case LOGIC_OC | NOT_MOD:
+    return [this, a, b, next]()
+    { regs[PC_REG] = next; regs[a] = ~regs[b]; };
+  case LOGIC_OC | AND_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] & regs[c]; };
+  case LOGIC_OC | OR_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] | regs[c]; };
+  case LOGIC_OC | XOR_MOD:
+    return [this, a, b, c, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] ^ regs[c]; };
+  case STORE_OC | STORE_MOD0:
+    return [this, a, b, c, d, next]()
+    { regs[PC_REG] = next; addToMemory(regs[a] + regs[b] + d, regs[c]); };
+  case STORE_OC | STORE_MOD2:
+    return [this, a, c, d, next]()
+    { regs[PC_REG] = next; regs[a] += d; addToMemory(regs[a], regs[c]); };
+  case LOAD_OC | LOAD_MOD0:
+    return [this, a, b, next]()
+    { regs[PC_REG] = next; regs[a] = csrRegs[b]; };
+  case LOAD_OC | LOAD_MOD1:
+    return [this, a, b, d, next]()
+    { regs[PC_REG] = next; regs[a] = regs[b] + d; };
+  case LOAD_OC | LOAD_MOD2:
+    return [this, a, b, c, d, next]()
+    { regs[PC_REG] = next; regs[a] = getFromMemory(regs[b] + regs[c] + d); };
+  case LOAD_OC | LOAD_MOD3:
+    return [this, a, b, d, next]()
+    { regs[PC_REG] = next; regs[a] = getFromMemory(regs[b]); regs[b] += d; };
   }
+
+  // Everything else goes through its interpreter handler with the operands baked in
+  InstructionHandler handler = getOpcodeHandler(ins.op);
+  return [this, handler, ins, next]() mutable
+  { regs[PC_REG] = next; (this->*handler)(ins); };
+}
+
+void Emulator::handleHalt(Instruction &)
+{
+  // Zaustavlja procesor kao i dalje izvršavanje narednih instrukcija.
+  emulation = false;
+}
+
+void Emulator::handleInt(Instruction &)
+{
+  enterInterrupt(SOFTWARE_CAUSE);
+}
+
+void Emulator::handleXchg(Instruction &ins)
+{
+  // temp<=gpr[B]; gpr[B]<=gpr[C]; gpr[C]<=temp;
+  swap(regs[ins.B], regs[ins.C]);
 }
 
 void Emulator::handleCall(Instruction &ins)
@@ -214,16 +2424,10 @@ void Emulator::handleCall(Instruction &ins)
   switch (ins.op)
   {
   case CALL_OC | CALL_MOD0:
-    // push pc; pc<=gpr[A]+gpr[B]+D;
-    cout << "callMod0" << endl;
-    handleStore(PUSH_PC);
-    regs[PC_REG] = regs[ins.A] + regs[ins.B] + complement2(ins.D);
+    opCallMod0(ins);
     break;
   case CALL_OC | CALL_MOD1:
-    // push pc; pc<=mem32[gpr[A]+gpr[B]+D];
-    cout << "callMod1" << endl;
-    handleStore(PUSH_PC);
-    regs[PC_REG] = getFromMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D));
+    opCallMod1(ins);
     break;
   }
 }
@@ -233,62 +2437,28 @@ void Emulator::handleJump(Instruction &ins)
   switch (ins.op)
   {
   case JUMP_OC | JMP_MOD0:
-    // pc<=gpr[A]+D;
-    cout << "jmpMod0" << endl;
-    regs[PC_REG] = regs[ins.A] + complement2(ins.D);
+    opJmpMod0(ins);
     break;
   case JUMP_OC | JMP_MOD1:
-    // if (gpr[B] == gpr[C]) pc<=gpr[A]+D;
-    cout << "jmpMod1" << endl;
-    if (regs[ins.B] == regs[ins.C])
-    {
-      regs[PC_REG] = regs[ins.A] + complement2(ins.D);
-    }
+    opJmpMod1(ins);
     break;
   case JUMP_OC | JMP_MOD2:
-    // if (gpr[B] != gpr[C]) pc<=gpr[A]+D;
-    cout << "jmpMod2" << endl;
-    if (regs[ins.B] != regs[ins.C])
-    {
-      regs[PC_REG] = regs[ins.A] + complement2(ins.D);
-    }
+    opJmpMod2(ins);
     break;
   case JUMP_OC | JMP_MOD3:
-    // if (gpr[B] signed> gpr[C]) pc<=gpr[A]+D;
-    cout << "jmpMod3" << endl;
-    if ((int)regs[ins.B] > (int)regs[ins.C])
-    {
-      regs[PC_REG] = regs[PC_REG] = regs[ins.A] + complement2(ins.D);
-    }
+    opJmpMod3(ins);
     break;
   case JUMP_OC | JMP_MOD4:
-    // pc<=mem32[gpr[A]+D];
-    cout << "jmpMod4" << endl;
-    regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
+    opJmpMod4(ins);
     break;
   case JUMP_OC | JMP_MOD5:
-    // if (gpr[B] == gpr[C]) pc<=mem32[gpr[A]+D];
-    cout << "jmpMod5" << endl;
-    if (regs[ins.B] == regs[ins.C])
-    {
-      regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
-    }
+    opJmpMod5(ins);
     break;
   case JUMP_OC | JMP_MOD6:
-    // if (gpr[B] != gpr[C]) pc<=mem32[gpr[A]+D];
-    cout << "jmpMod6" << endl;
-    if (regs[ins.B] != regs[ins.C])
-    {
-      regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
-    }
+    opJmpMod6(ins);
     break;
   case JUMP_OC | JMP_MOD7:
-    // if (gpr[B] signed> gpr[C]) pc<=mem32[gpr[A]+D];
-    cout << "jmpMod7" << endl;
-    if (regs[ins.B] > regs[ins.C])
-    {
-      regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
-    }
+    opJmpMod7(ins);
     break;
   }
 }
@@ -298,24 +2468,16 @@ void Emulator::handleArit(Instruction &ins)
   switch (ins.op)
   {
   case ARIT_OC | ADD_MOD:
-    // gpr[A]<=gpr[B] + gpr[C];
-    cout << "add" << endl;
-    regs[ins.A] = regs[ins.B] + regs[ins.C];
+    opAdd(ins);
     break;
   case ARIT_OC | SUB_MOD:
-    // gpr[A]<=gpr[B] - gpr[C];
-    cout << "sub" << endl;
-    regs[ins.A] = regs[ins.B] - regs[ins.C];
+    opSub(ins);
     break;
   case ARIT_OC | MUL_MOD:
-    // gpr[A]<=gpr[B] * gpr[C];
-    cout << "mul" << endl;
-    regs[ins.A] = regs[ins.B] * regs[ins.C];
+    opMul(ins);
     break;
   case ARIT_OC | DIV_MOD:
-    // gpr[A]<=gpr[B] / gpr[C];
-    cout << "div" << endl;
-    regs[ins.A] = regs[ins.B] / regs[ins.C];
+    opDiv(ins);
     break;
   }
 }
@@ -325,41 +2487,29 @@ void Emulator::handleLogic(Instruction &ins)
   switch (ins.op)
   {
   case LOGIC_OC | NOT_MOD:
-    // gpr[A]<=~gpr[B];
-    cout << "not" << endl;
-    regs[ins.A] = ~regs[ins.B];
+    opNot(ins);
     break;
   case LOGIC_OC | AND_MOD:
-    // gpr[A]<=gpr[B] & gpr[C];
-    cout << "and" << endl;
-    regs[ins.A] = regs[ins.B] & regs[ins.C];
+    opAnd(ins);
     break;
   case LOGIC_OC | OR_MOD:
-    // gpr[A]<=gpr[B] | gpr[C]
-    cout << "or" << endl;
-    regs[ins.A] = regs[ins.B] | regs[ins.C];
+    opOr(ins);
     break;
   case LOGIC_OC | XOR_MOD:
-    // gpr[A]<=gpr[B] ^ gpr[C];
-    cout << "xor" << endl;
-    regs[ins.A] = regs[ins.B] ^ regs[ins.C];
+    opXor(ins);
     break;
   }
 }
 
-void Emulator::handleShift(Instruction &inst)
+void Emulator::handleShift(Instruction &ins)
 {
-  switch (inst.op)
+  switch (ins.op)
   {
   case SHIFT_OC | SHL_MOD:
-    // gpr[A]<=gpr[B] << gpr[C];
-    cout << "shl" << endl;
-    regs[inst.A] = regs[inst.B] << regs[inst.C];
+    opShl(ins);
     break;
   case SHIFT_OC | SHR_MOD:
-    // gpr[A]<=gpr[B] >> gpr[C];
-    cout << "shr" << endl;
-    regs[inst.A] = regs[inst.B] >> regs[inst.C];
+    opShr(ins);
     break;
   }
 }
@@ -369,20 +2519,13 @@ void Emulator::handleStore(Instruction &ins)
   switch (ins.op)
   {
   case STORE_OC | STORE_MOD0:
-    // mem32[gpr[A]+gpr[B]+D]<=gpr[C];
-    cout << "storeMod0" << endl;
-    addToMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D), regs[ins.C]);
+    opStoreMod0(ins);
     break;
   case STORE_OC | STORE_MOD1:
-    // mem32[mem32[gpr[A]+gpr[B]+D]]<=gpr[C];
-    cout << "storeMod1" << endl;
-    addToMemory(getFromMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D)), regs[ins.C]);
+    opStoreMod1(ins);
     break;
   case STORE_OC | STORE_MOD2:
-    // gpr[A]<=gpr[A]+D; mem32[gpr[A]]<=gpr[C];
-    cout << "storeMod2" << endl;
-    regs[ins.A] += complement2(ins.D);
-    addToMemory(regs[ins.A], regs[ins.C]);
+    opStoreMod2(ins);
     break;
   }
 }
@@ -392,46 +2535,261 @@ void Emulator::handleLoad(Instruction &ins)
   switch (ins.op)
   {
   case LOAD_OC | LOAD_MOD0:
-    // gpr[A]<=csr[B];
-    cout << "loadMod0" << endl;
-    regs[ins.A] = csrRegs[ins.B];
+    opLoadMod0(ins);
     break;
   case LOAD_OC | LOAD_MOD1:
-    // gpr[A]<=gpr[B]+D;
-    cout << "loadMod1" << endl;
-    regs[ins.A] = regs[ins.B] + complement2(ins.D);
+    opLoadMod1(ins);
     break;
   case LOAD_OC | LOAD_MOD2:
-    // gpr[A]<=mem32[gpr[B]+gpr[C]+D];
-    cout << "loadMod2" << endl;
-    regs[ins.A] = getFromMemory(regs[ins.B] + regs[ins.C] + complement2(ins.D));
+    opLoadMod2(ins);
     break;
   case LOAD_OC | LOAD_MOD3:
-    // gpr[A]<=mem32[gpr[B]]; gpr[B]<=gpr[B]+D;
-    cout << "loadMod3" << endl;
-    regs[ins.A] = getFromMemory(regs[ins.B]);
-    regs[ins.B] += complement2(ins.D);
+    opLoadMod3(ins);
     break;
   case LOAD_OC | LOAD_MOD4:
-    // csr[A]<=gpr[B];
-    cout << "loadMod4" << endl;
-    csrRegs[ins.A] = regs[ins.B];
+    opLoadMod4(ins);
     break;
   case LOAD_OC | LOAD_MOD5:
-    // csr[A]<=csr[B]|D;
-    cout << "loadMod5" << endl;
-    csrRegs[ins.A] = csrRegs[ins.B] | complement2(ins.D);
+    opLoadMod5(ins);
     break;
   case LOAD_OC | LOAD_MOD6:
-    // csr[A]<=mem32[gpr[B]+gpr[C]+D];
-    cout << "loadMod6" << endl;
-    csrRegs[ins.A] = getFromMemory(regs[ins.B] + regs[ins.C] + complement2(ins.D));
+    opLoadMod6(ins);
     break;
   case LOAD_OC | LOAD_MOD7:
-    // csr[A]<=mem32[gpr[B]]; gpr[B]<=gpr[B]+D;
-    cout << "loadMod7" << endl;
-    csrRegs[ins.A] = getFromMemory(regs[ins.B]);
-    regs[ins.B] += complement2(ins.D);
+    opLoadMod7(ins);
     break;
   }
 }
+
+void Emulator::opCallMod0(Instruction &ins)
+{
+  // push pc; pc<=gpr[A]+gpr[B]+D;
+  handleStore(PUSH_PC);
+  const unsigned int returnAddress = regs[PC_REG];
+  regs[PC_REG] = regs[ins.A] + regs[ins.B] + complement2(ins.D);
+  if (profiling)
+    profiler.call(regs[PC_REG], returnAddress);
+}
+
+void Emulator::opCallMod1(Instruction &ins)
+{
+  // push pc; pc<=mem32[gpr[A]+gpr[B]+D];
+  handleStore(PUSH_PC);
+  const unsigned int returnAddress = regs[PC_REG];
+  regs[PC_REG] = getFromMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D));
+  if (profiling)
+    profiler.call(regs[PC_REG], returnAddress);
+}
+
+void Emulator::opJmpMod0(Instruction &ins)
+{
+  // pc<=gpr[A]+D;
+  regs[PC_REG] = regs[ins.A] + complement2(ins.D);
+}
+
+void Emulator::opJmpMod1(Instruction &ins)
+{
+  // if (gpr[B] == gpr[C]) pc<=gpr[A]+D;
+  if (regs[ins.B] == regs[ins.C])
+  {
+    regs[PC_REG] = regs[ins.A] + complement2(ins.D);
+  }
+}
+
+void Emulator::opJmpMod2(Instruction &ins)
+{
+  // if (gpr[B] != gpr[C]) pc<=gpr[A]+D;
+  if (regs[ins.B] != regs[ins.C])
+  {
+    regs[PC_REG] = regs[ins.A] + complement2(ins.D);
+  }
+}
+
+void Emulator::opJmpMod3(Instruction &ins)
+{
+  // if (gpr[B] signed> gpr[C]) pc<=gpr[A]+D;
+  if ((int)regs[ins.B] > (int)regs[ins.C])
+  {
+    regs[PC_REG] = regs[ins.A] + complement2(ins.D);
+  }
+}
+
+void Emulator::opJmpMod4(Instruction &ins)
+{
+  // pc<=mem32[gpr[A]+D];
+  regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
+}
+
+void Emulator::opJmpMod5(Instruction &ins)
+{
+  // if (gpr[B] == gpr[C]) pc<=mem32[gpr[A]+D];
+  if (regs[ins.B] == regs[ins.C])
+  {
+    regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
+  }
+}
+
+void Emulator::opJmpMod6(Instruction &ins)
+{
+  // if (gpr[B] != gpr[C]) pc<=mem32[gpr[A]+D];
+  if (regs[ins.B] != regs[ins.C])
+  {
+    regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
+  }
+}
+
+void Emulator::opJmpMod7(Instruction &ins)
+{
+  // if (gpr[B] signed> gpr[C]) pc<=mem32[gpr[A]+D];
+  if (regs[ins.B] > regs[ins.C])
+  {
+    regs[PC_REG] = getFromMemory(regs[ins.A] + complement2(ins.D));
+  }
+}
+
+void Emulator::opAdd(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] + gpr[C];
+  regs[ins.A] = regs[ins.B] + regs[ins.C];
+}
+
+void Emulator::opSub(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] - gpr[C];
+  regs[ins.A] = regs[ins.B] - regs[ins.C];
+}
+
+void Emulator::opMul(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] * gpr[C];
+  regs[ins.A] = regs[ins.B] * regs[ins.C];
+}
+
+void Emulator::opDiv(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] / gpr[C];
+  if (regs[ins.C] == 0)
+  {
+    fault("Division by zero");
+    return;
+  }
+  regs[ins.A] = regs[ins.B] / regs[ins.C];
+}
+
+void Emulator::opNot(Instruction &ins)
+{
+  // gpr[A]<=~gpr[B];
+  regs[ins.A] = ~regs[ins.B];
+}
+
+void Emulator::opAnd(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] & gpr[C];
+  regs[ins.A] = regs[ins.B] & regs[ins.C];
+}
+
+void Emulator::opOr(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] | gpr[C]
+  regs[ins.A] = regs[ins.B] | regs[ins.C];
+}
+
+void Emulator::opXor(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] ^ gpr[C];
+  regs[ins.A] = regs[ins.B] ^ regs[ins.C];
+}
+
+void Emulator::opShl(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] << gpr[C];
+  regs[ins.A] = regs[ins.B] << regs[ins.C];
+}
+
+void Emulator::opShr(Instruction &ins)
+{
+  // gpr[A]<=gpr[B] >> gpr[C];
+  regs[ins.A] = regs[ins.B] >> regs[ins.C];
+}
+
+void Emulator::opStoreMod0(Instruction &ins)
+{
+  // mem32[gpr[A]+gpr[B]+D]<=gpr[C];
+  addToMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D), regs[ins.C]);
+}
+
+void Emulator::opStoreMod1(Instruction &ins)
+{
+  // mem32[mem32[gpr[A]+gpr[B]+D]]<=gpr[C];
+  addToMemory(getFromMemory(regs[ins.A] + regs[ins.B] + complement2(ins.D)), regs[ins.C]);
+}
+
+void Emulator::opStoreMod2(Instruction &ins)
+{
+  // gpr[A]<=gpr[A]+D; mem32[gpr[A]]<=gpr[C];
+  regs[ins.A] += complement2(ins.D);
+  addToMemory(regs[ins.A], regs[ins.C]);
+}
+
+void Emulator::opLoadMod0(Instruction &ins)
+{
+  // gpr[A]<=csr[B];
+  regs[ins.A] = csrRegs[ins.B];
+}
+
+void Emulator::opLoadMod1(Instruction &ins)
+{
+  // gpr[A]<=gpr[B]+D;
+  regs[ins.A] = regs[ins.B] + complement2(ins.D);
+}
+
+void Emulator::opLoadMod2(Instruction &ins)
+{
+  // gpr[A]<=mem32[gpr[B]+gpr[C]+D];
+  regs[ins.A] = getFromMemory(regs[ins.B] + regs[ins.C] + complement2(ins.D));
+  if (profiling && ins.A == PC_REG)
+    profiler.ret(regs[PC_REG]);
+}
+
+void Emulator::opLoadMod3(Instruction &ins)
+{
+  // gpr[A]<=mem32[gpr[B]]; gpr[B]<=gpr[B]+D;
+  regs[ins.A] = getFromMemory(regs[ins.B]);
+  regs[ins.B] += complement2(ins.D);
+  if (profiling && ins.A == PC_REG)
+    profiler.ret(regs[PC_REG]);
+}
+
+void Emulator::opLoadMod4(Instruction &ins)
+{
+  // csr[A]<=gpr[B];
+  writeCsr(ins.A, regs[ins.B]);
+  retryInterrupts();
+}
+
+void Emulator::opLoadMod5(Instruction &ins)
+{
+  // csr[A]<=csr[B]|D;
+  writeCsr(ins.A, csrRegs[ins.B] | complement2(ins.D));
+  retryInterrupts();
+}
+
+void Emulator::opLoadMod6(Instruction &ins)
+{
+  // csr[A]<=mem32[gpr[B]+gpr[C]+D];
+  writeCsr(ins.A, getFromMemory(regs[ins.B] + regs[ins.C] + complement2(ins.D)));
+  retryInterrupts();
+}
+
+void Emulator::opLoadMod7(Instruction &ins)
+{
+  // csr[A]<=mem32[gpr[B]]; gpr[B]<=gpr[B]+D;
+  writeCsr(ins.A, getFromMemory(regs[ins.B]));
+  regs[ins.B] += complement2(ins.D);
+  retryInterrupts();
+}
+
+void Emulator::handleInvalid(Instruction &)
+{
+  // Unknown operation codes are skipped
+}
\ No newline at end of file
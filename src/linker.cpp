@@ -2,15 +2,24 @@
 #include "../inc/util.hpp"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
+#ifndef DRIVER
 int main(int argc, char *argv[])
 {
     cout << "LINKER | Start" << endl;
@@ -21,6 +30,13 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    string outputFormat = argv[1];
+    if (outputFormat != "-hex" && outputFormat != "-bin")
+    {
+        cout << "ERROR | Output format must be -hex or -bin" << endl;
+        return -1;
+    }
+
     // Find the index of the output file in the command line arguments
     int outputId = -1;
     for (int i = 1; i < argc; i++)
@@ -39,38 +55,53 @@ int main(int argc, char *argv[])
 
     Linker linker;
 
-    // Parsing input files
-    vector<string> inputFiles = linker.extractInputFiles(outputId, argc, argv);
-    for (const string &f : inputFiles)
+    // -incremental=<cache> relinks from the cache when only section contents changed,
+    // -symbols=<file> writes the resolved symbol map, which needs every object parsed
+    string cacheName, symbolsName;
+    for (int i = 2; i < outputId - 1; i++)
     {
-        ifstream file(f);
-        if (!file.is_open())
-        {
-            cout << "ERROR | Failed to open the file: " << f << endl;
-            return -1;
-        }
-        cout << "LINKER | Parsing file: " << f << endl;
-
-        FileEntry entry({f});
-        linker.parseSymbols(file, entry);
-        linker.parseSections(file, entry);
-        linker.parseRelocs(file, entry);
-
-        file.close();
-        linker.getFileEntries().push_back(entry);
+        string argument = argv[i];
+        if (argument.rfind("-incremental=", 0) == 0)
+            cacheName = argument.substr(13);
+        else if (argument.rfind("-symbols=", 0) == 0)
+            symbolsName = argument.substr(9);
     }
 
     // @
+    vector<string> inputFiles = linker.extractInputFiles(outputId, argc, argv);
     vector<SectionPlace> sectionPlaces = linker.extractSectionPlaces(outputId, argv);
     sort(sectionPlaces.begin(), sectionPlaces.end(), [](const SectionPlace &lhs, const SectionPlace &rhs)
          { return lhs.baseAddress < rhs.baseAddress; });
-    sectionPlaces.empty() ? linker.fillMemory0() : linker.fillMemory(sectionPlaces);
 
-    // Resolve
-    linker.resolveSymbols();
-    linker.resolveRelocs();
+    if (cacheName.empty() || !symbolsName.empty() || !linker.relink(cacheName, inputFiles, sectionPlaces))
+    {
+        // Parsing input files
+        if (!linker.parseFiles(inputFiles))
+            return -1;
+
+        linker.indexSections();
+        sectionPlaces.empty() ? linker.fillMemory0() : linker.fillMemory(sectionPlaces);
 
-    // Info output
+        // Resolve
+        linker.resolveSymbols();
+        linker.resolveRelocs();
+
+        if (!cacheName.empty() && !linker.writeCache(cacheName, linker.buildCache(inputFiles, sectionPlaces)))
+            cout << "WARNING | Failed to write the link cache: " << cacheName << endl;
+    }
+
+    if (!symbolsName.empty())
+    {
+        ofstream symbolsFile(symbolsName);
+        if (!symbolsFile)
+        {
+            cout << "ERROR | Failed to open the file: " << symbolsName << endl;
+            return -1;
+        }
+        linker.writeSymbolMap(symbolsFile);
+    }
+
+    // Info output, after a relink the file sections only cover the re-parsed objects
     string outputTextFile = "linker.txt";
     ofstream outputFile(outputTextFile);
     if (!outputFile)
@@ -101,18 +132,22 @@ int main(int argc, char *argv[])
 
     // Linker output
     string linkerOutputFile = string(argv[outputId]);
-    ofstream linkerOutput(linkerOutputFile);
+    ofstream linkerOutput(linkerOutputFile, outputFormat == "-bin" ? ios::binary : ios::out);
     if (!linkerOutput)
     {
         cout << "ERROR | Failed to open the file: " << linkerOutputFile << endl;
         return -1;
     }
-    linker.writeLinkerOutput(linkerOutput);
+    if (outputFormat == "-bin")
+        linker.writeBinaryOutput(linkerOutput);
+    else
+        linker.writeLinkerOutput(linkerOutput);
 
     cout << "LINKER | End" << endl;
 
     return 0;
 }
+#endif
 
 // For main
 vector<SectionPlace> Linker::extractSectionPlaces(int id, char *argv[])
@@ -120,20 +155,26 @@ vector<SectionPlace> Linker::extractSectionPlaces(int id, char *argv[])
     vector<SectionPlace> sectionPlaces;
     for (int i = 2; i < id - 1; i++)
     {
-        string argument = argv[i];
-        size_t pos = argument.find("=");
-        string extractedString = argument.substr(pos + 1);
-
-        pos = extractedString.find("@");
-        string text = extractedString.substr(0, pos);
-        string str = extractedString.substr(pos + 1);
-        unsigned int num = stoul(str, nullptr, 16);
-
-        sectionPlaces.push_back({text, num});
+        if (string(argv[i]).rfind("-place=", 0) == 0)
+            sectionPlaces.push_back(parseSectionPlace(argv[i]));
     }
     return sectionPlaces;
 }
 
+SectionPlace Linker::parseSectionPlace(const string &argument)
+{
+    // -place=<section>@<hex address>
+    size_t pos = argument.find("=");
+    string extractedString = argument.substr(pos + 1);
+
+    pos = extractedString.find("@");
+    string text = extractedString.substr(0, pos);
+    string str = extractedString.substr(pos + 1);
+    unsigned int num = stoul(str, nullptr, 16);
+
+    return {text, num};
+}
+
 // For main
 vector<string> Linker::extractInputFiles(int id, int argc, char *argv[])
 {
@@ -145,9 +186,198 @@ vector<string> Linker::extractInputFiles(int id, int argc, char *argv[])
     return files;
 }
 
+bool Linker::parseFile(const string &name, FileEntry &entry)
+{
+    entry.name = name;
+
+    uint32_t magic = 0;
+    ifstream file(name, ios::binary);
+    if (!file.is_open())
+        return false;
+    file.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    if (file && magic == OBJECT_MAGIC)
+        return parseObject(name, entry);
+
+    file.clear();
+    file.seekg(0);
+    parseSymbols(file, entry);
+    parseSections(file, entry);
+    parseRelocs(file, entry);
+
+    file.close();
+    return true;
+}
+
+bool Linker::parseObject(const string &name, FileEntry &entry)
+{
+    int fd = open(name.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(ObjectHeader)))
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return false;
+
+    // Section contents are used in place, so the mapping lives as long as the entry
+    entry.mapping = shared_ptr<void>(addr, [size](void *p)
+                                     { munmap(p, size); });
+    const char *base = static_cast<const char *>(addr);
+
+    ObjectHeader header;
+    memcpy(&header, base, sizeof(header));
+    auto fits = [size](unsigned long long offset, unsigned long long length)
+    { return offset + length <= size; };
+    if (header.version != OBJECT_VERSION || header.sectionCnt == 0 ||
+        !fits(header.symbolOffset, static_cast<unsigned long long>(header.symbolCnt) * sizeof(ObjectSymbol)) ||
+        !fits(header.sectionOffset, static_cast<unsigned long long>(header.sectionCnt) * sizeof(ObjectSection)) ||
+        !fits(header.relocOffset, static_cast<unsigned long long>(header.relocCnt) * sizeof(ObjectReloc)) ||
+        !fits(header.stringOffset, header.stringSize) || header.stringSize == 0 ||
+        base[header.stringOffset + header.stringSize - 1] != '\0')
+        return false;
+
+    const char *strings = base + header.stringOffset;
+    const ObjectSymbol *symbols = reinterpret_cast<const ObjectSymbol *>(base + header.symbolOffset);
+    const ObjectSection *sections = reinterpret_cast<const ObjectSection *>(base + header.sectionOffset);
+    const ObjectReloc *relocs = reinterpret_cast<const ObjectReloc *>(base + header.relocOffset);
+
+    entry.symbolTable.reserve(header.symbolCnt);
+    for (uint32_t i = 0; i < header.symbolCnt; i++)
+    {
+        const ObjectSymbol &symbol = symbols[i];
+        if (symbol.name >= header.stringSize || symbol.sectionId < 0 || symbol.sectionId >= static_cast<int32_t>(header.sectionCnt))
+            return false;
+        entry.symbolTable.push_back({strings + symbol.name, symbol.sectionId, symbol.offset, symbol.isGlobal != 0, symbol.isSection != 0});
+    }
+
+    entry.sectionTable.reserve(header.sectionCnt);
+    for (uint32_t i = 0; i < header.sectionCnt; i++)
+    {
+        const ObjectSection &section = sections[i];
+        if (section.name >= header.stringSize || (section.size && !fits(section.dataOffset, section.size)) ||
+            static_cast<unsigned long long>(section.firstReloc) + section.relocCnt > header.relocCnt)
+            return false;
+
+        SectionEntry sectionEntry({strings + section.name});
+        sectionEntry.size = section.size;
+        sectionEntry.data = section.size ? base + section.dataOffset : nullptr;
+        for (uint32_t j = section.firstReloc; j < section.firstReloc + section.relocCnt; j++)
+        {
+            if (relocs[j].symbolId < 0 || relocs[j].symbolId >= static_cast<int32_t>(header.symbolCnt))
+                return false;
+            sectionEntry.relocs.push_back({relocs[j].offset, relocs[j].symbolId, relocs[j].addend});
+        }
+        entry.sectionTable.push_back(move(sectionEntry));
+    }
+    entry.sectionCnt = header.sectionCnt - 1; // UND section
+
+    return true;
+}
+
+bool Linker::parseFiles(const vector<string> &names)
+{
+    // Files are parsed independently on a pool of threads, each into its own slot,
+    // so the result is in command-line order regardless of scheduling
+    vector<FileEntry> entries(names.size());
+    vector<char> opened(names.size(), false);
+    atomic<size_t> next(0);
+
+    auto worker = [&]()
+    {
+        for (size_t i = next++; i < names.size(); i = next++)
+            opened[i] = parseFile(names[i], entries[i]);
+    };
+
+    size_t threadCnt = min<size_t>(max(1u, thread::hardware_concurrency()), names.size());
+    vector<thread> pool;
+    for (size_t i = 1; i < threadCnt; i++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto &t : pool)
+        t.join();
+
+    for (size_t i = 0; i < names.size(); i++)
+    {
+        if (!opened[i])
+        {
+            cout << "ERROR | Failed to read the file: " << names[i] << endl;
+            return false;
+        }
+        cout << "LINKER | Parsing file: " << names[i] << endl;
+    }
+
+    fileEntries.insert(fileEntries.end(), make_move_iterator(entries.begin()), make_move_iterator(entries.end()));
+    return true;
+}
+
+int Linker::internSection(const string &name)
+{
+    auto it = sectionIds.find(name);
+    if (it != sectionIds.end())
+        return it->second;
+
+    sectionIds.emplace(name, sectionNames.size());
+    sectionNames.push_back(name);
+    return sectionNames.size() - 1;
+}
+
+void Linker::indexSections()
+{
+    // Interning in file order keeps ids in order of first appearance
+    internSection("UND");
+    for (auto &obj : fileEntries)
+    {
+        for (auto &section : obj.sectionTable)
+            section.nameId = internSection(section.name);
+    }
+
+    // Only the first section of a given name in each file takes part in placement
+    sectionInputs.assign(sectionNames.size(), {});
+    processedSections.assign(sectionNames.size(), false);
+    outputIndex.assign(sectionNames.size(), -1);
+    processedSections[internSection("UND")] = true;
+
+    vector<int> lastFile(sectionNames.size(), -1);
+    for (int i = 0; i < fileEntries.size(); i++)
+    {
+        for (auto &section : fileEntries[i].sectionTable)
+        {
+            if (lastFile[section.nameId] == i)
+                continue;
+            lastFile[section.nameId] = i;
+            sectionInputs[section.nameId].push_back(&section);
+        }
+    }
+}
+
+void Linker::placeSection(int nameId, unsigned int &baseAddress)
+{
+    LinkerMemoryEntry entry({sectionNames[nameId]});
+    entry.baseAddress = baseAddress;
+
+    for (SectionEntry *section : sectionInputs[nameId])
+    {
+        section->baseAddress = baseAddress;
+        baseAddress += section->size;
+        entry.memory.insert(entry.memory.end(), section->bytes(), section->bytes() + section->byteCount());
+        processedSections[nameId] = true;
+    }
+
+    outputIndex[nameId] = linkerMemory.size();
+    linkerMemory.push_back(entry);
+}
+
 void Linker::parseSymbols(ifstream &file, FileEntry &fEntry)
 {
-    sectionCnt = 0;
+    int sectionCnt = 0;
     string line;
     getline(file, line); // Skip #.
     getline(file, line); // Skip var names
@@ -182,14 +412,13 @@ void Linker::parseSections(ifstream &file, FileEntry &fEntry)
 {
     // UND section
     SectionEntry entry({"UND"});
-    processedSections.insert("UND");
     fEntry.sectionTable.push_back(entry);
 
     string line;
     int section_counter = 0;
     streampos currentPosition;
 
-    while (getline(file, line) && section_counter < sectionCnt)
+    while (getline(file, line) && section_counter < fEntry.sectionCnt)
     {
         if (!line.empty() && line[0] == '#')
         {
@@ -229,6 +458,15 @@ void Linker::parseRelocs(ifstream &file, FileEntry &fEntry)
         if (line[0] == '#')
         {
             string sectionName = line.substr(line.find_last_of('.') + 1);
+            SectionEntry *section = nullptr;
+            for (auto &sec : fEntry.sectionTable)
+            {
+                if (sec.name == sectionName)
+                {
+                    section = &sec;
+                    break;
+                }
+            }
             string entryLine;
 
             while (getline(file, entryLine))
@@ -242,16 +480,8 @@ void Linker::parseRelocs(ifstream &file, FileEntry &fEntry)
                 int offset, symbol, addend;
                 ss >> offset >> symbol >> addend;
 
-                for (auto &section : fEntry.sectionTable)
-                {
-                    if (section.name == sectionName)
-                    {
-                        RelocationEntry entry({offset, symbol, addend});
-
-                        section.relocs.push_back(entry);
-                        break;
-                    }
-                }
+                if (section)
+                    section->relocs.push_back(RelocationEntry({offset, symbol, addend}));
             }
         }
     }
@@ -259,34 +489,18 @@ void Linker::parseRelocs(ifstream &file, FileEntry &fEntry)
 
 void Linker::fillMemory(vector<SectionPlace> section_places)
 {
+    // Placed names need not appear in any input
+    for (const auto &place : section_places)
+        internSection(place.sectionName);
+    processedSections.resize(sectionNames.size(), false);
+    outputIndex.resize(sectionNames.size(), -1);
+    sectionInputs.resize(sectionNames.size());
+
     // Sections from command line
     for (const auto &place : section_places)
     {
-        string sectionName = place.sectionName;
         unsigned int baseAddress = place.baseAddress;
-        LinkerMemoryEntry entry({sectionName});
-        entry.baseAddress = baseAddress;
-
-        for (auto &obj : fileEntries)
-        {
-            // Find section and process it
-            SectionEntry *section = nullptr;
-            for (auto &sec : obj.sectionTable)
-            {
-                if (sec.name == sectionName)
-                {
-                    section = &sec;
-                    break;
-                }
-            }
-            if (!section)
-                continue;
-            section->baseAddress = baseAddress;
-            baseAddress += section->size;
-            entry.memory.insert(entry.memory.end(), section->memory.begin(), section->memory.end());
-            processedSections.insert(sectionName);
-        }
-        linkerMemory.push_back(entry);
+        placeSection(sectionIds[place.sectionName], baseAddress);
     }
 
     // Check for overlapping sections
@@ -300,66 +514,21 @@ void Linker::fillMemory(vector<SectionPlace> section_places)
     }
 
     // Find new base address
-    const string &name = section_places.back().sectionName;
-    unsigned int new_base_address = 0;
-
-    for (const auto &memory : linkerMemory)
-    {
-        if (memory.sectionName == name)
-        {
-            new_base_address = memory.memory.size() + memory.baseAddress;
-        }
-    }
+    const LinkerMemoryEntry &last = linkerMemory[outputIndex[sectionIds[section_places.back().sectionName]]];
+    unsigned int new_base_address = last.memory.size() + last.baseAddress;
 
-    // Remaining sections
-    vector<string> section_names;
-    for (const auto &obj : fileEntries)
+    // Remaining sections, in order of first appearance
+    for (int nameId = 0; nameId < sectionNames.size(); nameId++)
     {
-        if (obj.sectionCnt == 0)
-            continue;
-
-        for (const auto &section : obj.sectionTable)
-        {
-            if (processedSections.find(section.name) != processedSections.end())
-                continue;
-
-            if (find(section_names.begin(), section_names.end(), section.name) == section_names.end())
-            {
-                section_names.push_back(section.name);
-            }
-        }
-    }
-    for (const auto &sectionName : section_names)
-    {
-        LinkerMemoryEntry entry({sectionName});
-        entry.baseAddress = new_base_address;
-
-        for (auto &obj : fileEntries)
-        {
-            SectionEntry *section = nullptr;
-            for (auto &sec : obj.sectionTable)
-            {
-                if (sec.name == sectionName)
-                {
-                    section = &sec;
-                    break;
-                }
-            }
-            if (!section)
-                continue;
-            section->baseAddress = new_base_address;
-            new_base_address += section->size;
-            entry.memory.insert(entry.memory.end(), section->memory.begin(), section->memory.end());
-            processedSections.insert(sectionName);
-        }
-
-        linkerMemory.push_back(entry);
+        if (!processedSections[nameId] && !sectionInputs[nameId].empty())
+            placeSection(nameId, new_base_address);
     }
 }
 
 void Linker::resolveSymbols()
 {
-    // Global symbols
+    // Defined symbols, indexing the global ones by name
+    globalSymbols.clear();
     for (auto &obj : fileEntries)
     {
         for (auto it = obj.symbolTable.begin() + 1; it != obj.symbolTable.end(); ++it)
@@ -368,10 +537,12 @@ void Linker::resolveSymbols()
             {
                 int sectionId = it->sectionId;
                 it->offset += obj.sectionTable[sectionId].baseAddress;
-                // cout << obj.name << ": "
-                //      << (it->isGlobal ? "Global" : "Local")
-                //      << " symbol " << it->name << " = "
-                //      << static_cast<unsigned>(it->offset) << endl;
+
+                if (it->isGlobal && !globalSymbols.emplace(it->name, it->offset).second)
+                {
+                    cout << "ERROR | Global symbol " << it->name << " is defined multiple times" << endl;
+                    exit(-1);
+                }
             }
         }
     }
@@ -383,25 +554,13 @@ void Linker::resolveSymbols()
         {
             if (it->sectionId == 0)
             {
-                for (const auto &obj : fileEntries)
-                {
-                    for (const auto &objSymb : obj.symbolTable)
-                    {
-                        if (objSymb.name == it->name && objSymb.isGlobal && objSymb.sectionId != 0)
-                        {
-                            it->offset = objSymb.offset;
-                            // cout << obj.name << ": "
-                            //      << "Extern symbol " << it->name << " = "
-                            //      << static_cast<unsigned>(it->offset) << endl;
-                            break;
-                        }
-                    }
-                }
-                if (it->offset == 0)
+                auto global = globalSymbols.find(it->name);
+                if (global == globalSymbols.end())
                 {
                     cout << "ERROR | Extern symbol " << it->name << " is not defined as global anywhere" << endl;
                     exit(-1);
                 }
+                it->offset = global->second;
             }
         }
     }
@@ -413,16 +572,7 @@ void Linker::resolveRelocs()
     {
         for (auto &section : obj.sectionTable)
         {
-            int sectionId = -1;
-            for (int i = 0; i < linkerMemory.size(); i++)
-            {
-                if (linkerMemory[i].sectionName == section.name)
-                {
-                    sectionId = i;
-                    break;
-                }
-            }
-
+            int sectionId = outputIndex[section.nameId];
             if (sectionId == -1)
                 continue;
 
@@ -441,87 +591,529 @@ void Linker::resolveRelocs()
     }
 }
 
-void Linker::writeMemContent(ofstream &file, unsigned int &currAddress, LinkerMemoryEntry &entry, int i, int k)
+// "xx " for every byte value
+static const array<array<char, 3>, 256> HEX_BYTES = []()
 {
-    stringstream addrStream;
-    addrStream << hex << setfill('0') << setw(4) << currAddress;
-    string hexAddress = addrStream.str();
+    const char *digits = "0123456789abcdef";
+    array<array<char, 3>, 256> table;
+    for (int i = 0; i < 256; i++)
+        table[i] = {digits[i >> 4], digits[i & 0xF], ' '};
+    return table;
+}();
+
+void HexWriter::write(unsigned int address, const char *bytes, size_t size)
+{
+    constexpr auto LINE_LENGTH = 8 + 2 + 8 * 3 + 1;
+
+    while (size > 0)
+    {
+        // A gap closes the open line, padded with zeros
+        if (lineFill != 0 && address != lineAddress + lineFill)
+            endLine();
+
+        if (lineFill == 0)
+        {
+            if (used + LINE_LENGTH > buffer.size())
+                flush();
+
+            lineAddress = address;
+            for (int shift = 28; shift >= 0; shift -= 4)
+                buffer[used++] = "0123456789abcdef"[(address >> shift) & 0xF];
+            buffer[used++] = ':';
+            buffer[used++] = ' ';
+        }
+
+        int count = min<size_t>(8 - lineFill, size);
+        for (int i = 0; i < count; i++, used += 3)
+            memcpy(&buffer[used], HEX_BYTES[static_cast<unsigned char>(bytes[i])].data(), 3);
 
-    file << hexAddress << ": ";
+        bytes += count;
+        size -= count;
+        address += count;
+        lineFill += count;
+        if (lineFill == 8)
+            endLine();
+    }
+}
+
+void HexWriter::endLine()
+{
+    for (; lineFill != 0 && lineFill < 8; lineFill++, used += 3)
+        memcpy(&buffer[used], HEX_BYTES[0].data(), 3);
+    buffer[used++] = '\n';
+    lineFill = 0;
+}
+
+void HexWriter::flush()
+{
+    if (lineFill != 0)
+        endLine();
+    if (used == 0)
+        return;
+
+    output.write(buffer.data(), used);
+    used = 0;
+}
 
-    for (int j = 0; j < k; j++)
+void Linker::writeLinkerOutput(ofstream &file)
+{
+    HexWriter writer(file);
+    for (const LinkerMemoryEntry &entry : linkerMemory)
+        writer.write(entry.baseAddress, entry.memory.data(), entry.memory.size());
+    writer.flush();
+}
+
+void Linker::writeSymbolMap(ofstream &file)
+{
+    // "<hex address> <name>" for every defined symbol, sections by their base
+    for (const auto &obj : fileEntries)
     {
-        file << setw(2) << setfill('0') << right << hex << static_cast<int>(static_cast<unsigned char>(entry.memory[j + i * 8])) << " ";
-        file << dec << setfill(' ');
+        for (auto it = obj.symbolTable.begin() + 1; it != obj.symbolTable.end(); ++it)
+        {
+            if (it->sectionId == 0)
+                continue;
+            unsigned int address = it->isSection ? obj.sectionTable[it->sectionId].baseAddress : it->offset;
+            file << hex << setw(8) << setfill('0') << address << dec << setfill(' ') << " " << it->name << "\n";
+        }
     }
 }
 
-int Linker::writeMem(ofstream &file, bool &div, LinkerMemoryEntry &entry)
+void Linker::writeBinaryOutput(ofstream &file)
 {
-    div = entry.memory.size() % 8 != 0;
-    unsigned int currAddress = entry.baseAddress;
+    // Merge sections into page-aligned segments so the emulator can map them directly
+    vector<ImageSegment> segments;
+    vector<vector<char>> contents;
+    for (const LinkerMemoryEntry &entry : linkerMemory)
+    {
+        if (entry.memory.empty())
+            continue;
+
+        unsigned long long start = entry.baseAddress & ~PAGE_MASK;
+        unsigned long long end = (static_cast<unsigned long long>(entry.baseAddress) + entry.memory.size() + PAGE_MASK) & ~static_cast<unsigned long long>(PAGE_MASK);
+
+        if (segments.empty() || start > segments.back().baseAddress + static_cast<unsigned long long>(segments.back().size))
+        {
+            segments.push_back({static_cast<uint32_t>(start), 0});
+            contents.push_back({});
+        }
+
+        ImageSegment &segment = segments.back();
+        vector<char> &content = contents.back();
+        if (end > segment.baseAddress + static_cast<unsigned long long>(segment.size))
+        {
+            segment.size = end - segment.baseAddress;
+            content.resize(segment.size, 0);
+        }
+        copy(entry.memory.begin(), entry.memory.end(), content.begin() + (entry.baseAddress - segment.baseAddress));
+    }
 
-    int i = 0;
-    for (; i < entry.memory.size() / 8; i++)
+    ImageHeader header;
+    header.segmentCnt = segments.size();
+    unsigned int offset = (sizeof(ImageHeader) + segments.size() * sizeof(ImageSegment) + PAGE_MASK) & ~PAGE_MASK;
+    for (auto &segment : segments)
     {
-        writeMemContent(file, currAddress, entry, i, 8);
-        file << endl;
-        currAddress += 8;
+        segment.fileOffset = offset;
+        offset += segment.size;
     }
 
-    if (div)
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char *>(segments.data()), segments.size() * sizeof(ImageSegment));
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        file.seekp(segments[i].fileOffset);
+        file.write(contents[i].data(), contents[i].size());
+    }
+}
+uint64_t Linker::hashFile(const string &name)
+{
+    // 64-bit FNV-1a over the file contents, 0 if it can't be read
+    ifstream file(name, ios::binary);
+    if (!file)
+        return 0;
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    vector<char> buffer(1 << 16);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
     {
-        // Need to print last 4 bytes
-        writeMemContent(file, currAddress, entry, i, 4);
-        currAddress += 4;
+        for (streamsize i = 0; i < file.gcount(); i++)
+            hash = (hash ^ static_cast<unsigned char>(buffer[i])) * 0x100000001b3ull;
     }
+    return hash;
+}
 
-    return currAddress;
+template <typename T>
+static void writeValue(ostream &os, T value)
+{
+    os.write(reinterpret_cast<const char *>(&value), sizeof(value));
 }
 
-int Linker::fillLine(ofstream &file, bool fill0, bool &div, LinkerMemoryEntry &entry)
+static void writeString(ostream &os, const string &str)
 {
-    for (int j = 0; j < 4; j++)
+    writeValue<uint32_t>(os, str.size());
+    os.write(str.data(), str.size());
+}
+
+template <typename T>
+static bool readValue(istream &is, T &value)
+{
+    return static_cast<bool>(is.read(reinterpret_cast<char *>(&value), sizeof(value)));
+}
+
+static bool readString(istream &is, string &str)
+{
+    uint32_t size;
+    if (!readValue(is, size) || size > (1u << 24))
+        return false;
+    str.resize(size);
+    return static_cast<bool>(is.read(&str[0], size));
+}
+
+bool Linker::writeCache(const string &name, const LinkCache &cache)
+{
+    ofstream file(name, ios::binary);
+    if (!file)
+        return false;
+
+    writeValue<uint32_t>(file, CACHE_MAGIC);
+    writeValue<uint32_t>(file, CACHE_VERSION);
+
+    writeValue<uint32_t>(file, cache.places.size());
+    for (const auto &place : cache.places)
     {
-        int value = fill0 ? 0 : static_cast<int>(static_cast<unsigned char>(entry.memory[j]));
-        file << setw(2) << setfill('0') << right << hex << value << " ";
+        writeString(file, place.sectionName);
+        writeValue<uint32_t>(file, place.baseAddress);
     }
 
-    file << dec << setfill(' ') << endl;
+    writeValue<uint32_t>(file, cache.objects.size());
+    for (const auto &obj : cache.objects)
+    {
+        writeString(file, obj.name);
+        writeValue<uint64_t>(file, obj.hash);
+        writeValue<uint32_t>(file, obj.sections.size());
+        for (const auto &section : obj.sections)
+        {
+            writeString(file, section.name);
+            writeValue<uint32_t>(file, section.size);
+            writeValue<uint32_t>(file, section.baseAddress);
+        }
+        writeValue<uint32_t>(file, obj.globals.size());
+        for (const auto &global : obj.globals)
+            writeString(file, global);
+        writeValue<uint32_t>(file, obj.externRefs.size());
+        for (const auto &ref : obj.externRefs)
+        {
+            writeString(file, ref.symbol);
+            writeValue<uint32_t>(file, ref.memoryId);
+            writeValue<uint32_t>(file, ref.offset);
+        }
+    }
+
+    writeValue<uint32_t>(file, cache.memory.size());
+    for (const auto &entry : cache.memory)
+    {
+        writeString(file, entry.sectionName);
+        writeValue<uint32_t>(file, entry.baseAddress);
+        writeValue<uint32_t>(file, entry.memory.size());
+        file.write(entry.memory.data(), entry.memory.size());
+    }
 
-    if (!fill0)
+    writeValue<uint32_t>(file, cache.globals.size());
+    for (const auto &global : cache.globals)
     {
-        entry.memory.erase(entry.memory.begin(), entry.memory.begin() + 4);
-        entry.baseAddress += 4;
+        writeString(file, global.first);
+        writeValue<int32_t>(file, global.second);
     }
 
-    return writeMem(file, div, entry);
+    return static_cast<bool>(file);
 }
 
-void Linker::writeLinkerOutput(ofstream &file)
+bool Linker::readCache(const string &name, LinkCache &cache)
+{
+    ifstream file(name, ios::binary);
+    uint32_t magic, version, count;
+    if (!file || !readValue(file, magic) || !readValue(file, version) || magic != CACHE_MAGIC || version != CACHE_VERSION)
+        return false;
+
+    if (!readValue(file, count))
+        return false;
+    cache.places.resize(count);
+    for (auto &place : cache.places)
+    {
+        if (!readString(file, place.sectionName) || !readValue(file, place.baseAddress))
+            return false;
+    }
+
+    if (!readValue(file, count))
+        return false;
+    cache.objects.resize(count);
+    for (auto &obj : cache.objects)
+    {
+        if (!readString(file, obj.name) || !readValue(file, obj.hash) || !readValue(file, count))
+            return false;
+        obj.sections.resize(count);
+        for (auto &section : obj.sections)
+        {
+            uint32_t size, base;
+            if (!readString(file, section.name) || !readValue(file, size) || !readValue(file, base))
+                return false;
+            section.size = size;
+            section.baseAddress = base;
+        }
+
+        if (!readValue(file, count))
+            return false;
+        obj.globals.resize(count);
+        for (auto &global : obj.globals)
+        {
+            if (!readString(file, global))
+                return false;
+        }
+
+        if (!readValue(file, count))
+            return false;
+        obj.externRefs.resize(count);
+        for (auto &ref : obj.externRefs)
+        {
+            if (!readString(file, ref.symbol) || !readValue(file, ref.memoryId) || !readValue(file, ref.offset))
+                return false;
+        }
+    }
+
+    if (!readValue(file, count))
+        return false;
+    cache.memory.resize(count);
+    for (auto &entry : cache.memory)
+    {
+        uint32_t size;
+        if (!readString(file, entry.sectionName) || !readValue(file, entry.baseAddress) || !readValue(file, size))
+            return false;
+        entry.memory.resize(size);
+        if (!file.read(entry.memory.data(), size))
+            return false;
+    }
+
+    if (!readValue(file, count))
+        return false;
+    cache.globals.resize(count);
+    for (auto &global : cache.globals)
+    {
+        if (!readString(file, global.first) || !readValue(file, global.second))
+            return false;
+    }
+
+    // Every reference has to land inside the linked memory
+    for (const auto &obj : cache.objects)
+    {
+        for (const auto &ref : obj.externRefs)
+        {
+            if (ref.memoryId < 0 || ref.memoryId >= static_cast<int>(cache.memory.size()) ||
+                static_cast<size_t>(ref.offset) + 4 > cache.memory[ref.memoryId].memory.size())
+                return false;
+        }
+    }
+    return true;
+}
+
+void Linker::cacheObject(FileEntry &obj, CachedObject &cached)
+{
+    // Called once symbols and relocations of the object are resolved
+    cached.sections.clear();
+    for (const auto &section : obj.sectionTable)
+    {
+        SectionEntry entry({section.name});
+        entry.size = section.size;
+        entry.baseAddress = section.baseAddress;
+        cached.sections.push_back(entry);
+    }
+
+    cached.globals.clear();
+    for (auto it = obj.symbolTable.begin() + 1; it != obj.symbolTable.end(); ++it)
+    {
+        if (it->sectionId != 0 && it->isGlobal)
+            cached.globals.push_back(it->name);
+    }
+
+    // Words patched with extern symbols, repatched when their definition moves
+    cached.externRefs.clear();
+    for (auto &section : obj.sectionTable)
+    {
+        int sectionId = outputIndex[section.nameId];
+        if (sectionId == -1)
+            continue;
+
+        for (const auto &reloc : section.relocs)
+        {
+            const SymbolEntry &symbol = obj.symbolTable[reloc.symbolId];
+            if (symbol.sectionId != 0 || symbol.isSection)
+                continue;
+            unsigned int off = reloc.offset + section.baseAddress - linkerMemory[sectionId].baseAddress;
+            cached.externRefs.push_back({symbol.name, sectionId, off});
+        }
+    }
+}
+
+LinkCache Linker::buildCache(const vector<string> &names, const vector<SectionPlace> &places)
+{
+    LinkCache cache;
+    cache.places = places;
+    cache.objects.resize(fileEntries.size());
+    for (size_t i = 0; i < fileEntries.size(); i++)
+    {
+        cache.objects[i].name = names[i];
+        cache.objects[i].hash = hashFile(names[i]);
+        cacheObject(fileEntries[i], cache.objects[i]);
+    }
+    cache.memory = linkerMemory;
+    cache.globals.assign(globalSymbols.begin(), globalSymbols.end());
+    return cache;
+}
+
+bool Linker::relink(const string &cacheName, const vector<string> &names, const vector<SectionPlace> &places)
 {
-    bool outputDiv = false;
-    unsigned int currAddress = 0;
-    for (LinkerMemoryEntry &entry : linkerMemory)
+    // Anything that would move a section falls back to a full link from a clean state
+    auto fallBack = [&](const string &reason)
+    {
+        cout << "LINKER | Full link: " << reason << endl;
+        fileEntries.clear();
+        linkerMemory.clear();
+        globalSymbols.clear();
+        sectionIds.clear();
+        sectionNames.clear();
+        return false;
+    };
+
+    LinkCache cache;
+    if (!readCache(cacheName, cache))
+        return fallBack("no usable link cache");
+
+    bool samePlaces = cache.places.size() == places.size();
+    for (size_t i = 0; samePlaces && i < places.size(); i++)
+        samePlaces = cache.places[i].sectionName == places[i].sectionName && cache.places[i].baseAddress == places[i].baseAddress;
+    bool sameInputs = cache.objects.size() == names.size();
+    for (size_t i = 0; sameInputs && i < names.size(); i++)
+        sameInputs = cache.objects[i].name == names[i];
+    if (!samePlaces || !sameInputs)
+        return fallBack("inputs or placements changed");
+
+    vector<size_t> changed;
+    vector<uint64_t> hashes;
+    vector<string> changedNames;
+    for (size_t i = 0; i < names.size(); i++)
     {
-        bool consecutive = currAddress == entry.baseAddress;
+        uint64_t hash = hashFile(names[i]);
+        if (hash == cache.objects[i].hash)
+            continue;
+        changed.push_back(i);
+        hashes.push_back(hash);
+        changedNames.push_back(names[i]);
+    }
+
+    if (!changedNames.empty() && !parseFiles(changedNames))
+        return fallBack("changed input can't be read");
+
+    linkerMemory = move(cache.memory);
+    globalSymbols.clear();
+    globalSymbols.insert(cache.globals.begin(), cache.globals.end());
+
+    // Output sections are known by name, ids are only needed for the changed objects
+    for (size_t i = 0; i < linkerMemory.size(); i++)
+        internSection(linkerMemory[i].sectionName);
+    outputIndex.assign(sectionNames.size(), -1);
+    for (size_t i = 0; i < linkerMemory.size(); i++)
+        outputIndex[sectionIds[linkerMemory[i].sectionName]] = i;
 
-        if (outputDiv)
+    // Same sections with the same sizes and the same globals keep the layout, take their bases over
+    unordered_map<string, int> movedGlobals;
+    for (size_t k = 0; k < changed.size(); k++)
+    {
+        FileEntry &obj = fileEntries[k];
+        const CachedObject &cached = cache.objects[changed[k]];
+        if (obj.sectionTable.size() != cached.sections.size())
+            return fallBack("sections of " + obj.name + " changed");
+
+        for (size_t j = 0; j < obj.sectionTable.size(); j++)
         {
-            currAddress = fillLine(file, !consecutive, outputDiv, entry);
+            SectionEntry &section = obj.sectionTable[j];
+            if (section.name != cached.sections[j].name || section.size != cached.sections[j].size)
+                return fallBack("sections of " + obj.name + " changed");
+            section.baseAddress = cached.sections[j].baseAddress;
+            section.nameId = internSection(section.name);
+            outputIndex.resize(sectionNames.size(), -1);
         }
-        else
+
+        vector<string> globals;
+        for (auto it = obj.symbolTable.begin() + 1; it != obj.symbolTable.end(); ++it)
         {
-            currAddress = writeMem(file, outputDiv, entry);
+            if (it->sectionId == 0)
+                continue;
+            it->offset += obj.sectionTable[it->sectionId].baseAddress;
+            if (!it->isGlobal)
+                continue;
+            globals.push_back(it->name);
+            if (globalSymbols[it->name] != it->offset)
+                movedGlobals[it->name] = it->offset;
+            globalSymbols[it->name] = it->offset;
         }
+        if (globals != cached.globals)
+            return fallBack("globals of " + obj.name + " changed");
     }
 
-    if (outputDiv)
+    // Externs of the changed objects, then their contents and relocations
+    for (size_t k = 0; k < changed.size(); k++)
     {
-        for (int i = 0; i < 4; i++)
+        FileEntry &obj = fileEntries[k];
+        for (auto it = obj.symbolTable.begin() + 1; it != obj.symbolTable.end(); ++it)
         {
-            file << setw(2) << setfill('0') << right << hex << 0 << " ";
+            if (it->sectionId != 0)
+                continue;
+            auto global = globalSymbols.find(it->name);
+            if (global == globalSymbols.end())
+                return fallBack("extern symbol " + it->name + " is not defined");
+            it->offset = global->second;
+        }
+
+        // Only the first section of a name in a file is placed, as in indexSections
+        vector<bool> placed(sectionNames.size(), false);
+        for (auto &section : obj.sectionTable)
+        {
+            int sectionId = outputIndex[section.nameId];
+            if (sectionId == -1 || placed[section.nameId])
+                continue;
+            placed[section.nameId] = true;
+            LinkerMemoryEntry &entry = linkerMemory[sectionId];
+            copy(section.bytes(), section.bytes() + section.byteCount(), entry.memory.begin() + (section.baseAddress - entry.baseAddress));
+        }
+    }
+    resolveRelocs();
+
+    // Words in unchanged objects that point at globals which moved
+    vector<bool> isChanged(names.size(), false);
+    for (size_t i : changed)
+        isChanged[i] = true;
+    for (size_t i = 0; i < names.size() && !movedGlobals.empty(); i++)
+    {
+        if (isChanged[i])
+            continue;
+        for (const auto &ref : cache.objects[i].externRefs)
+        {
+            auto moved = movedGlobals.find(ref.symbol);
+            if (moved == movedGlobals.end())
+                continue;
+            for (int j = 0; j < 4; ++j)
+                linkerMemory[ref.memoryId].memory[ref.offset + j] = getByte(moved->second, j);
         }
-        file << dec << setfill(' ') << endl;
     }
-}
\ No newline at end of file
+
+    for (size_t k = 0; k < changed.size(); k++)
+    {
+        cache.objects[changed[k]].hash = hashes[k];
+        cacheObject(fileEntries[k], cache.objects[changed[k]]);
+    }
+    cache.memory = linkerMemory;
+    cache.globals.assign(globalSymbols.begin(), globalSymbols.end());
+    if (!writeCache(cacheName, cache))
+        cout << "WARNING | Failed to write the link cache: " << cacheName << endl;
+
+    cout << "LINKER | Relinked " << changed.size() << " of " << names.size() << " objects" << endl;
+    return true;
+}
@@ -0,0 +1,26 @@
+# file: term_output.s
+# ispisuje 1000000 linija na terminal (merenje propusnosti terminala)
+
+.section my_code
+my_start:
+    ld $0xFFFFFEFE, %sp
+    ld $1, %r1
+    csrwr %r1, %status # maskira prekid tajmera
+    ld $0xFFFFFF00, %r2
+    ld $1000000, %r5
+    ld $0, %r6
+    ld $1, %r4
+line:
+    ld $0x61, %r1
+    ld $0x7B, %r3
+char:
+    st %r1, [%r2]
+    add %r4, %r1
+    bne %r1, %r3, char
+    ld $0x0A, %r1
+    st %r1, [%r2]
+    add %r4, %r6
+    bne %r6, %r5, line
+    halt
+
+.end